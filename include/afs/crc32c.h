@@ -0,0 +1,17 @@
+// crc32c.h: CRC32C (Castagnoli) checksums
+
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Compute CRC32C of a buffer
+// @param	data	    Buffer to checksum
+// @param	length	    Number of bytes in buffer
+// @param	crc	    Checksum of preceding data (0 to start)
+// Uses the SSE4.2 crc32 instruction (three interleaved streams merged with
+// PCLMULQDQ) when the CPU supports it, and a slicing-by-8 table otherwise.
+uint32_t crc32c(const void *data, size_t length, uint32_t crc = 0);
+
+// Return whether crc32c is using the hardware implementation
+bool crc32c_hardware();
@@ -2,41 +2,82 @@
 
 #pragma once
 #include <sys/types.h>
+#include <sys/uio.h>
 #include <stdlib.h>
 
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+// Bytes per block, fixed at compile time. Build with -DAFS_BLOCK_SIZE=16384
+// (or see "make variants") to try larger blocks.
+#ifndef AFS_BLOCK_SIZE
+#define AFS_BLOCK_SIZE 4096
+#endif
+
+// Disk is the interface the file system sees: a fixed number of blocks that
+// can be read, written and discarded. It checks every request and keeps the
+// counters; backends (FileDisk, RamDisk, ModelDisk) only move the data.
 class Disk {
 private:
-    int	    FileDescriptor; // File descriptor of disk image
-    size_t  Blocks;	    // Number of blocks in disk image
-    size_t  Reads;	    // Number of reads performed
-    size_t  Writes;	    // Number of writes performed
+    size_t  Blocks;	    // Number of blocks in disk
+    std::atomic<size_t> Reads;	    // Number of reads performed
+    std::atomic<size_t> Writes;	    // Number of writes performed
+    std::atomic<size_t> Discards;   // Number of blocks discarded
     size_t  Mounts;	    // Number of mounts
+    bool    Opened;	    // Whether the backend has been opened
 
     // Check parameters
-    // @param	blocknum    Block to operate on
+    // @param	blocknum    First block to operate on
+    // @param	nblocks	    Number of blocks to operate on
     // @param	data	    Buffer to operate on
     // Throws invalid_argument exception on error.
-    void sanity_check(int blocknum, char *data);
+    void sanity_check(size_t blocknum, size_t nblocks, char *data);
+
+protected:
+    // Record that the backend is ready, with nblocks blocks
+    void opened(size_t nblocks);
+
+    // Backend operations, on blocks already checked to be in range
+    // @param	blocknum    First block to operate on
+    // @param	nblocks	    Number of consecutive blocks
+    // @param	data	    Buffer of nblocks*BLOCK_SIZE bytes
+    // Throw runtime_error exception on error.
+    virtual void read_blocks(size_t blocknum, size_t nblocks, char *data) = 0;
+    virtual void write_blocks(size_t blocknum, size_t nblocks, char *data) = 0;
+
+    // Returns false if the backend cannot give blocks back.
+    virtual bool discard_blocks(size_t blocknum, size_t nblocks) = 0;
 
 public:
     // Number of bytes per block
-    const static size_t BLOCK_SIZE = 4096;
-    
+    const static size_t BLOCK_SIZE = AFS_BLOCK_SIZE;
+
+    // Images made before the block size was recorded use this size
+    const static size_t LEGACY_BLOCK_SIZE = 4096;
+
+    // Blocks must hold a whole number of inodes of either format
+    static_assert((BLOCK_SIZE & (BLOCK_SIZE - 1)) == 0, "AFS_BLOCK_SIZE must be a power of two");
+    static_assert(BLOCK_SIZE >= 1024 && BLOCK_SIZE <= 65536, "AFS_BLOCK_SIZE must be between 1 KiB and 64 KiB");
+
     // Default constructor
-    Disk() : FileDescriptor(0), Blocks(0), Reads(0), Writes(0), Mounts(0) {}
-    
-    // Destructor
-    ~Disk();
+    Disk() : Blocks(0), Reads(0), Writes(0), Discards(0), Mounts(0), Opened(false) {}
 
-    // Open disk image
-    // @param	path	    Path to disk image
-    // @param	nblocks	    Number of blocks in disk image
-    // Throws runtime_error exception on error.
-    void open(const char *path, size_t nblocks);
+    // Destructor (prints the block counters of an opened disk)
+    virtual ~Disk();
 
     // Return size of disk (in terms of blocks)
     size_t size() const { return Blocks; }
 
+    // Return number of block reads / writes performed so far
+    size_t reads() const { return Reads.load(); }
+    size_t writes() const { return Writes.load(); }
+
     // Return whether or not disk is mounted
     bool mounted() const { return Mounts > 0; }
 
@@ -46,13 +87,116 @@ public:
     // Decrement mounts
     void unmount() { if (Mounts > 0) Mounts--; }
 
-    // Read block from disk
+    // Read block from disk (safe to call from multiple threads)
     // @param	blocknum    Block to read from
     // @param	data	    Buffer to read into
-    void read(int blocknum, char *data);
+    void read(size_t blocknum, char *data);
+
+    // Read consecutive blocks from disk into one buffer
+    // @param	blocknum    First block to read from
+    // @param	nblocks	    Number of blocks to read
+    // @param	data	    Buffer of nblocks*BLOCK_SIZE bytes to read into
+    void read(size_t blocknum, size_t nblocks, char *data);
     
-    // Write block to disk
+    // Write block to disk (safe to call from multiple threads)
     // @param	blocknum    Block to write to
     // @param	data	    Buffer to write from
-    void write(int blocknum, char *data);
+    void write(size_t blocknum, char *data);
+
+    // Write consecutive blocks to disk from one buffer
+    // @param	blocknum    First block to write to
+    // @param	nblocks	    Number of blocks to write
+    // @param	data	    Buffer of nblocks*BLOCK_SIZE bytes to write from
+    void write(size_t blocknum, size_t nblocks, char *data);
+
+    // Return blocks to the backend (punching holes in image files)
+    // @param	blocknum    First block to discard
+    // @param	nblocks	    Number of blocks to discard
+    // Returns false if the backend cannot discard blocks.
+    bool discard(size_t blocknum, size_t nblocks);
+};
+
+// FileDisk keeps the blocks in one host image file, or striped (RAID-0)
+// across several.
+class FileDisk : public Disk {
+private:
+    // One member's share of a transfer
+    struct Request {
+    	std::vector<struct iovec> Iovecs;   // Buffers to gather from or scatter to
+    	off_t	Offset;		    // Byte offset in the member image
+    	bool	Write;		    // Whether to write (or read)
+    	int	Error;		    // errno value if it failed (0 if not)
+    	bool	Done;		    // Whether a worker has finished it
+    };
+
+    // Every member but the first has a thread, started on open, that issues
+    // its share of transfers spanning several members
+    struct Worker {
+    	std::thread Thread;
+    	std::deque<Request *> Queue;	    // Requests waiting for the thread
+    	std::condition_variable Queued;	    // Signalled on a new request, or on close
+    };
+
+    std::vector<int> FileDescriptors;	// File descriptor of each member image
+    size_t  StripeBlocks;   // Blocks per stripe unit (striped disks only)
+    bool    Direct;	    // Whether images bypass the host page cache
+    std::vector<std::unique_ptr<Worker>> Workers;   // By member (none for the first)
+    std::mutex Lock;	    // Guards the queues, Done flags and Stopping
+    std::condition_variable Finished;	// Signalled when a worker finishes a request
+    bool    Stopping;	    // Whether the workers should exit
+
+    // Find the member image holding a block, and its byte offset there
+    void locate(size_t blocknum, size_t &member, off_t &offset) const;
+
+    // Read or write nblocks consecutive blocks, as one request per member
+    // (issued in parallel when more than one member is involved)
+    void transfer(size_t blocknum, size_t nblocks, char *data, bool write);
+
+    // Issue a request in full on one member, retrying short transfers
+    void issue(size_t member, Request &request);
+
+    // Run a member's worker thread until the disk is closed
+    void work(size_t member);
+
+    // Stage a request through an aligned buffer, for O_DIRECT images
+    void bounce(size_t blocknum, size_t nblocks, char *data, bool write);
+
+protected:
+    void read_blocks(size_t blocknum, size_t nblocks, char *data);
+    void write_blocks(size_t blocknum, size_t nblocks, char *data);
+    bool discard_blocks(size_t blocknum, size_t nblocks);
+
+public:
+    // Default blocks per stripe unit
+    const static size_t STRIPE_BLOCKS = 4;
+
+    // Default constructor
+    FileDisk() : StripeBlocks(0), Direct(false), Stopping(false) {}
+
+    // Destructor
+    ~FileDisk();
+
+    // Open disk image
+    // @param	path	    Path to disk image
+    // @param	nblocks	    Number of blocks in disk image
+    // @param	direct	    Open with O_DIRECT, bypassing the host page cache
+    // @param	read_only   Open an existing image of at least nblocks without
+    //			    writing, resizing or creating it
+    // Throws runtime_error exception on error.
+    void open(const char *path, size_t nblocks, bool direct = false, bool read_only = false);
+
+    // Open a disk striped (RAID-0) across several images
+    // @param	paths	    Path to each member image
+    // @param	nblocks	    Number of blocks in the whole disk
+    // @param	stripe_blocks Consecutive blocks placed on one member
+    // @param	direct	    Open with O_DIRECT, bypassing the host page cache
+    // @param	read_only   Open existing images without writing or resizing them
+    // Throws runtime_error exception on error.
+    void open(const std::vector<std::string> &paths, size_t nblocks, size_t stripe_blocks = STRIPE_BLOCKS, bool direct = false, bool read_only = false);
+
+    // Return whether the images were opened with O_DIRECT
+    bool direct() const { return Direct; }
+
+    // Return number of member images
+    size_t members() const { return FileDescriptors.size(); }
 };
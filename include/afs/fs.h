@@ -3,22 +3,77 @@
 #pragma once
 
 #include "afs/disk.h"
+#include "afs/pool.h"
 
 #include <stdint.h>
 
+#include <map>
+#include <memory>
+#include <vector>
+
 class FileSystem {
 public:
     const static uint32_t MAGIC_NUMBER	     = 0xf0f03410;
-    const static uint32_t INODES_PER_BLOCK   = 128;
+    const static uint32_t MAGIC_NUMBER_EXT   = 0xf0f03411;  // Version 1 with checksums and block size
+    const static uint32_t MAGIC_NUMBER_V2    = 0xf0f03420;
     const static uint32_t POINTERS_PER_INODE = 5;
-    const static uint32_t POINTERS_PER_BLOCK = 1024;
+    const static uint32_t CHECKSUMS_PER_BLOCK = Disk::BLOCK_SIZE / sizeof(uint32_t);
+    const static uint32_t REFCOUNTS_PER_BLOCK = Disk::BLOCK_SIZE / sizeof(uint32_t);
+    const static uint32_t DEFRAG_BATCH	     = 64;
+
+    // Version 1: 32-bit block pointers and sizes
+    const static uint32_t INODE_SIZE	     = 32;
+    const static uint32_t INODES_PER_BLOCK   = Disk::BLOCK_SIZE / INODE_SIZE;
+    const static uint32_t POINTERS_PER_BLOCK = Disk::BLOCK_SIZE / sizeof(uint32_t);
+
+    // Version 2: 64-bit block pointers and sizes
+    const static uint32_t INODE_SIZE_V2	       = 64;
+    const static uint32_t INODES_PER_BLOCK_V2   = Disk::BLOCK_SIZE / INODE_SIZE_V2;
+    const static uint32_t POINTERS_PER_BLOCK_V2 = Disk::BLOCK_SIZE / sizeof(uint64_t);
+    const static size_t   BYTES_PER_INODE_V2    = 16384;   // Default inode density
+    const static uint32_t REFCOUNT_CACHE_BLOCKS = 16;	   // Reference count blocks held in memory
+    const static uint32_t INDIRECT_LEVELS_V2    = 3;	   // Pointer block levels under Indirect, at most
+
+    // Inode Valid flags
+    const static uint32_t INODE_VALID	      = 1;
+    const static uint32_t INODE_PREALLOCATED  = 2;	   // May hold blocks past its size
+
+    // Inodes append keeps pinned in memory (without handles) at once
+    const static size_t   APPEND_STREAMS      = 64;
 
 private:
+    friend class FileSystemChecker;
+
     struct SuperBlock {		// Superblock structure
     	uint32_t MagicNumber;	// File system magic number
     	uint32_t Blocks;	// Number of blocks in file system
     	uint32_t InodeBlocks;	// Number of blocks reserved for inodes
     	uint32_t Inodes;	// Number of inodes in file system
+    	uint32_t ChecksumBlocks;// Number of blocks reserved for checksums (MAGIC_NUMBER_EXT only)
+    	uint32_t BlockSize;	// Bytes per block (MAGIC_NUMBER_EXT only)
+    };
+
+    struct SuperBlockV2 {	// Superblock structure (version 2)
+    	uint32_t MagicNumber;	// File system magic number
+    	uint32_t BlockSize;	// Bytes per block
+    	uint64_t Blocks;	// Number of blocks in file system
+    	uint64_t InodeBlocks;	// Number of blocks reserved for inodes
+    	uint64_t Inodes;	// Number of inodes in file system
+    	uint64_t ChecksumBlocks;// Number of blocks reserved for checksums
+    	uint64_t RefcountBlocks;// Number of blocks reserved for reference counts
+    };
+
+    // Layout of an image, read from either version of superblock
+    struct Geometry {
+    	uint32_t Version;	    // On-disk format version
+    	size_t	 BlockSize;	    // Bytes per block
+    	size_t	 Blocks;	    // Number of blocks in file system
+    	size_t	 InodeBlocks;	    // Number of blocks reserved for inodes
+    	size_t	 Inodes;	    // Number of inodes in file system
+    	size_t	 ChecksumBlocks;    // Number of blocks reserved for checksums
+    	size_t	 RefcountBlocks;    // Number of blocks reserved for reference counts
+    	size_t	 InodesPerBlock;    // Inodes in each inode block
+    	size_t	 PointersPerBlock;  // Pointers in an indirect block
     };
 
     struct Inode {
@@ -27,32 +82,152 @@ private:
     	uint32_t Direct[POINTERS_PER_INODE]; // Direct pointers
     	uint32_t Indirect;	// Indirect pointer
     };
+    static_assert(sizeof(Inode) == INODE_SIZE, "inodes must pack evenly into blocks");
+
+    // Version 2 inode; inodes of either version are held in memory this way
+    struct InodeV2 {
+    	uint32_t Valid;		// Whether or not inode is valid
+    	uint32_t Levels;	// Levels of pointer blocks from Indirect down (0 is 1)
+    	uint64_t Size;		// Size of file
+    	uint64_t Direct[POINTERS_PER_INODE]; // Direct pointers
+    	uint64_t Indirect;	// Indirect pointer, the root of the pointer tree
+    };
+    static_assert(sizeof(InodeV2) == INODE_SIZE_V2, "inodes must pack evenly into blocks");
 
     union Block {
     	SuperBlock  Super;			    // Superblock
+    	SuperBlockV2 SuperV2;			    // Superblock (version 2)
     	Inode	    Inodes[INODES_PER_BLOCK];	    // Inode block
+    	InodeV2	    InodesV2[INODES_PER_BLOCK_V2];  // Inode block (version 2)
     	uint32_t    Pointers[POINTERS_PER_BLOCK];   // Pointer block
+    	uint64_t    PointersV2[POINTERS_PER_BLOCK_V2]; // Pointer block (version 2)
+    	uint32_t    Checksums[CHECKSUMS_PER_BLOCK]; // Checksum block
+    	uint32_t    Refcounts[REFCOUNTS_PER_BLOCK]; // Reference count block
     	char	    Data[Disk::BLOCK_SIZE];	    // Data block
     };
 
+    // Cached block of the on-disk reference count table
+    struct RefcountBlock {
+    	size_t	Blocknum = 0;	    // Table block held (0 if none)
+    	bool	Dirty = false;	    // Whether it changed since it was read
+    	Borrowed<Block> Data;
+    };
+
+    // Pointer blocks of a file by level, root first. Block k of a level
+    // holds pointers k*PointersPerBlock onwards of the level below it, and
+    // the last level holds the data block pointers past the direct ones.
+    typedef std::vector<std::vector<size_t>> PointerTree;
+
+    // Open inode: a pinned copy of the inode plus its block map, shared by
+    // every handle on the same file. Changes reach the disk on flush.
+    struct OpenInode {
+    	InodeV2	Node;		    // Pinned copy of the inode
+    	std::vector<size_t> Map;    // Data block pointers, in file order
+    	PointerTree Tree;	    // Pointer blocks holding Map, loaded with it
+    	bool	MapLoaded;	    // Whether Map and Tree have been built yet
+    	bool	Dirty;		    // Whether Node or Map changed since flush
+    	size_t	DirtyFrom;	    // First Map entry changed past the direct ones (-1 if none)
+    	size_t	Refs;		    // Number of handles open on the inode
+    	bool	Appending;	    // Whether append keeps it pinned without handles
+    	size_t	LastAppend;	    // When append last used it (for eviction)
+    	size_t	TailIndex;	    // Block of the file held in Tail (-1 if none)
+    	std::unique_ptr<Borrowed<Block>> Tail;	// Last partial block, kept by append
+    };
+
+    // Open file handle
+    struct Handle {
+    	size_t	Inumber;	    // Inode of the open file
+    	size_t	Offset;		    // Read/write cursor
+    	bool	Open;		    // Whether or not the handle is in use
+    };
+
+    // On-disk formats: superblocks, inodes and pointer blocks of either version
+    static bool	read_geometry(const Block &block, Geometry &geometry);
+    static void	decode_inode(const Geometry &geometry, const Block &block, size_t index, InodeV2 &inode);
+    static void	encode_inode(const Geometry &geometry, Block &block, size_t index, const InodeV2 &inode);
+    static uint64_t get_pointer(const Geometry &geometry, const Block &block, size_t index);
+    static void	set_pointer(const Geometry &geometry, Block &block, size_t index, uint64_t blocknum);
+    static size_t indirect_levels(const InodeV2 &inode) { return inode.Levels > 1 ? inode.Levels : 1; }
+    static size_t max_indirect_levels(const Geometry &geometry) { return geometry.Version == 2 ? INDIRECT_LEVELS_V2 : 1; }
+
     // TODO: Internal helper functions
     int    load_inode_block(size_t inumber, bool already_loaded=true);
     int    save_inode_block(size_t inumber);
+    bool    load_inode(size_t inumber, InodeV2 &inode, bool already_loaded=false);
+    bool    save_inode(size_t inumber, const InodeV2 &inode, bool already_loaded=false);
     size_t  find_free();
-    int    get_data_addrs(size_t inumber, int* tmp_array);
-    
+    size_t  find_free_run(size_t nblocks);
+    size_t  next_refcount(size_t from, bool free);
+    bool    get_data_addrs(const InodeV2 &inode, std::vector<size_t> &addrs, PointerTree *tree = NULL);
+    bool    read_pointers(size_t blocknum, size_t level, size_t levels, std::vector<size_t> &addrs, PointerTree *tree);
+    bool    grow_tree(PointerTree &tree, size_t entries);
+    void    release_tree(const PointerTree &tree);
+    bool    set_data_addrs(InodeV2 &inode, const std::vector<size_t> &addrs, const PointerTree &tree, size_t dirty_from, size_t dirty_to = -1);
+    void    release_block(size_t blocknum);
+    void    flush_discards();
+    OpenInode *open_inode(int handle);
+    OpenInode *pin_inode(size_t inumber);
+    bool    load_map(OpenInode &file);
+    size_t  map_append(OpenInode &file);
+    size_t  writable_block(OpenInode &file, size_t index);
+    void    flush_inode(size_t inumber, OpenInode &file);
+    void    sync_inode(size_t inumber, bool reload);
+    void    evict_inode(size_t inumber);
+    void    abort_mount();
+    size_t  data_start() const { return 1 + FS_Geometry.InodeBlocks + FS_Geometry.ChecksumBlocks + FS_Geometry.RefcountBlocks; }
+    bool    data_block(size_t blocknum) const { return blocknum >= data_start() && blocknum < FS_Geometry.Blocks; }
+
+    // Checksummed block I/O: every block after the superblock has a CRC32C
+    // entry in the checksum region (0 means none recorded yet). read_blocks
+    // returns how many blocks pass before the first that fails.
+    bool    read_block(size_t blocknum, char *data);
+    void    write_block(size_t blocknum, char *data);
+    size_t  read_blocks(size_t blocknum, size_t nblocks, char *data);
+    void    write_blocks(size_t blocknum, size_t nblocks, char *data);
+    uint32_t *checksum_entry(size_t blocknum);
+    void    flush_checksums();
+    static uint32_t block_checksum(const char *data);
+
+    // Block reference counts: rebuilt in FS_Bitmap at mount for version 1
+    // images, and kept in the on-disk table (through a small cache) for
+    // version 2, so mounting those costs the same at any size.
+    uint32_t refcount(size_t blocknum);
+    void    set_refcount(size_t blocknum, uint32_t count);
+    uint32_t *refcount_entry(size_t blocknum, bool dirty);
+    void    flush_refcounts();
+    void    flush_metadata();
+
     // TODO: Internal member variables
-    int* FS_Bitmap;
+    uint32_t* FS_Bitmap;    // Number of pointers to each block (0 if free), version 1 only
     int current_inode_block = 0;
     Disk* FS_Disk;
-    Block FS_Inode_Block;
-    Block FS_Data_Block;
-    uint32_t FS_Blocks;    // Number of blocks in file system
-    uint32_t FS_InodeBlocks;   // Number of blocks reserved for inodes
-    uint32_t FS_Inodes;    // Number of inodes in file system
+    Borrowed<Block> FS_Inode_Block;    // Block buffers come from the shared pool,
+    Borrowed<Block> FS_Data_Block;     // aligned for O_DIRECT disks
+    Geometry FS_Geometry;    // Layout of the mounted image
+    Borrowed<Block> FS_Checksum_Block;
+    size_t current_checksum_block = 0;
+    bool checksum_dirty = false;
+    size_t Checksum_Errors = 0;
+    std::vector<RefcountBlock> FS_Refcount_Cache;    // Reference count table blocks, version 2 only
+    size_t FS_Free_Hint = 0;    // Every block below this is in use
+    size_t FS_Inode_Hint = 0;    // Every inode below this is in use
+    bool Discard_Immediate = false;    // Discard blocks as soon as they are freed
+    std::vector<size_t> Pending_Discards;    // Freed blocks not yet discarded
+    std::map<size_t, OpenInode> FS_Open_Inodes;    // Open inodes by inode number
+    std::vector<Handle> FS_Handles;    // Open file handles
+    size_t Append_Clock = 0;    // Number of appends, to age pinned inodes
 public:
+    FileSystem() : FS_Bitmap(NULL), FS_Disk(NULL), FS_Geometry() {}
+    ~FileSystem();
+
     static void debug(Disk *disk);
-    static bool format(Disk *disk);
+
+    // Format a disk
+    // @param	disk		Disk to format
+    // @param	version		On-disk format: 1 (32-bit) or 2 (64-bit block addresses)
+    // @param	bytes_per_inode	Inode density (0 is 10% of the disk for version 1,
+    //				BYTES_PER_INODE_V2 for version 2)
+    static bool format(Disk *disk, uint32_t version = 1, size_t bytes_per_inode = 0);
 
 
     void print_block_list();
@@ -60,10 +235,84 @@ public:
     bool mount(Disk *disk);
 
     size_t create();
+
+    // Create up to count inodes at once, appending their numbers to
+    // inumbers; returns the number created (fewer if the table fills)
+    size_t create(size_t count, std::vector<size_t> &inumbers);
+
     bool    remove(size_t inumber);
+
+    // Create a new inode sharing all of inumber's data blocks; returns the
+    // new inode number, or -1. Version 2 only, since only it keeps the
+    // reference counts that let afsck tell a clone from a cross-link.
+    size_t  clone(size_t inumber);
+
     size_t stat(size_t inumber);
 
     size_t read(size_t inumber, char *data, size_t length, size_t offset);
     size_t write(size_t inumber, char *data, size_t length, size_t offset);
-};
 
+    // Open an inode for repeated I/O; returns a handle, or -1. The inode is
+    // pinned in memory and its block map built on first use, so reads and
+    // writes through the handle only touch data blocks until close.
+    int    open(size_t inumber);
+
+    // Flush the inode and block map of a handle and release it
+    bool   close(int handle);
+
+    // Move the cursor of a handle; returns the new offset, or -1
+    size_t seek(int handle, size_t offset);
+
+    // Read from / write to a handle at its cursor, advancing it; returns the
+    // number of bytes transferred (0 at end of file), or -1
+    size_t read(int handle, char *data, size_t length);
+    size_t write(int handle, char *data, size_t length);
+
+    // Append to the end of a file; returns the number of bytes written, or
+    // -1. The inode stays pinned with its last partial block in memory, so
+    // an append that fits in that block costs one block write. The inode
+    // itself reaches the disk on sync, on closing a handle on it, or when
+    // the file system goes away.
+    size_t append(size_t inumber, char *data, size_t length);
+
+    // Reserve blocks for length bytes past the end of a file, contiguous
+    // where possible, without changing its size (as fallocate with
+    // FALLOC_FL_KEEP_SIZE); returns the number of blocks reserved, or -1
+    size_t preallocate(size_t inumber, size_t length);
+
+    // Write back the inode and block map of a file that append changed
+    bool   sync(size_t inumber);
+
+    // Number of inodes in file system
+    size_t inodes() const { return FS_Geometry.Inodes; }
+
+    // Number of free data blocks
+    size_t free_blocks();
+
+    // Largest file, in blocks: version 1 has a single indirect block,
+    // version 2 up to a triple indirect tree
+    size_t max_file_blocks() const;
+
+    // Number of extents (runs of contiguous blocks) in a file, or -1
+    size_t fragmentation(size_t inumber);
+
+    // Move up to max_blocks of a file's data blocks towards one contiguous
+    // run, DEFRAG_BATCH blocks at a time; returns the number of blocks moved
+    // (0 once the file is one extent), or -1. Nothing is held between calls,
+    // so a caller can throttle by moving a batch at a time. A file sharing
+    // blocks with a clone is left in place, with the number of shared
+    // blocks stored in shared.
+    size_t defrag(size_t inumber, size_t max_blocks = -1, size_t *shared = NULL);
+
+    // Discard freed blocks at the end of each operation that frees them
+    void set_discard(bool immediate) { Discard_Immediate = immediate; }
+
+    // Discard every free data block; returns the number of blocks trimmed, or
+    // -1 if the host cannot punch holes
+    size_t trim();
+
+    // Number of checksum mismatches detected since mount. Reads that fail
+    // verification return an error (mount fails if inode or indirect blocks
+    // do), and the blocks are not rewritten from the corrupt contents.
+    size_t checksum_errors() const { return Checksum_Errors; }
+};
@@ -0,0 +1,104 @@
+// fsck.h: Offline file system consistency checker
+
+#pragma once
+
+#include "afs/disk.h"
+#include "afs/fs.h"
+
+#include <atomic>
+#include <map>
+#include <vector>
+
+#include <stdint.h>
+
+class FileSystemChecker {
+public:
+    // Summary of a check
+    struct Report {
+    	size_t Inodes;		// Number of valid inodes
+    	size_t DataBlocks;	// Number of blocks owned by inodes
+    	size_t SharedBlocks;	// Number of extra references to blocks shared by clones
+    	size_t FreeBlocks;	// Number of unowned data blocks
+    	size_t Errors;		// Number of problems found
+    	size_t Repaired;	// Number of problems repaired
+    };
+
+    // Constructor
+    // @param	disk	    Disk image to check (must not be mounted)
+    // @param	threads	    Number of scanning threads
+    // @param	repair	    Whether or not to repair problems found
+    // @param	verify_data Whether or not to verify data block checksums
+    FileSystemChecker(Disk *disk, size_t threads, bool repair, bool verify_data);
+
+    // Destructor
+    ~FileSystemChecker();
+
+    // Scan the image, print each problem and return a summary
+    Report check();
+
+private:
+    typedef FileSystem::Block Block;
+    typedef FileSystem::InodeV2 Inode;
+
+    enum ProblemKind {
+    	BAD_POINTER,	    // Pointer outside of the data region
+    	BAD_INDIRECT,	    // Pointer to a pointer block outside of the data region
+    	SHARED_BLOCK,	    // Block owned twice without a clone to account for it
+    	SIZE_TOO_LARGE,	    // Size needs more blocks than are allocated
+    	SIZE_TOO_SMALL,	    // Blocks allocated past the end of the file
+    	BAD_CHECKSUM,	    // Metadata block failed its checksum
+    	BAD_DATA_CHECKSUM,  // Data block failed its checksum
+    	BAD_REFCOUNT,	    // Reference count table disagrees with the pointers (version 2)
+    };
+
+    struct Problem {
+    	ProblemKind Kind;
+    	uint32_t    Inumber;
+    	uint64_t    Block;
+    	uint64_t    Size;	// Size of the file (or stored reference count)
+    	size_t	    Index;	// Position of the pointer in the file's block list
+
+    	bool operator<(const Problem &other) const {
+    	    return Inumber != other.Inumber ? Inumber < other.Inumber : Index < other.Index;
+	}
+    };
+
+    // Per-thread scanning state
+    struct Worker {
+    	std::vector<Problem> Problems;
+    	std::vector<Problem> Shared;	    // Data blocks also owned by another file
+    	size_t	Inodes;
+    	size_t	DataBlocks;
+    	size_t	ChecksumBlockNum;   // Cached checksum block
+    	Borrowed<Block> ChecksumBlock;
+    };
+
+    Disk	       *CK_Disk;
+    size_t		CK_Threads;
+    bool		CK_Repair;
+    bool		CK_VerifyData;
+    FileSystem::Geometry CK_Geometry;
+    size_t		CK_DataStart;	    // First block of the data region
+
+    std::atomic<uint32_t>  *Owners;	    // Owning inode + 1 for each block (0 if free)
+    std::atomic<size_t>	    NextInodeBlock; // Next inode block to hand to a worker
+    std::vector<uint32_t>   References;	    // Pointers to each block, checked against the table (version 2)
+    std::vector<uint32_t>   Stored;	    // Reference count table as read from disk (version 2)
+
+    bool    valid_data_block(uint64_t blocknum) const;
+    bool    verify_block(Worker &worker, size_t blocknum, const char *data);
+    bool    claim(Worker &worker, uint32_t inumber, size_t blocknum, size_t index, bool indirect);
+    void    scan(Worker &worker);
+    void    scan_inode(Worker &worker, uint32_t inumber, Inode &inode);
+    bool    scan_pointers(Worker &worker, uint32_t inumber, const Inode &inode, size_t blocknum, size_t levels, std::vector<size_t> &blocks, bool end);
+    void    update_checksum(size_t blocknum, char *data);
+    size_t  truncate_inode(Inode &inode, size_t limit);
+    bool    truncate_pointers(size_t blocknum, size_t levels, size_t limit, size_t &count, bool &end);
+    std::vector<size_t> block_list(uint32_t inumber);
+    bool    walk_pointers(size_t blocknum, size_t levels, std::vector<size_t> &blocks, std::vector<uint32_t> *references);
+    void    repair_inode(uint32_t inumber, size_t truncate_at);
+    void    count_references();
+    void    check_references(std::vector<Problem> &problems);
+    bool    cross_linked(size_t blocknum) const;
+    void    repair_references();
+};
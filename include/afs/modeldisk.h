@@ -0,0 +1,57 @@
+// modeldisk.h: In-memory disk with a simulated device latency model
+
+#pragma once
+
+#include "afs/ramdisk.h"
+
+#include <mutex>
+
+// Timing parameters of a simulated device
+struct DiskModel {
+    const char *Name;	    // Short name ("hdd", "ssd")
+    double  Overhead;	    // Fixed cost of every request (microseconds)
+    double  SeekTime;	    // Full-stroke seek (microseconds); 0 for no seeks
+    double  Rotation;	    // Rotational delay after any seek (microseconds)
+    double  Bandwidth;	    // Transfer rate of one channel (MiB/s)
+    size_t  Channels;	    // Blocks of one request transferred in parallel
+
+    // 7200 RPM disk: seeks grow with the square root of the distance, and a
+    // request starting where the last one ended needs no seek at all
+    static const DiskModel HDD;
+
+    // Flash drive: no seeks, and the blocks of one request are spread over
+    // its channels, so deep (multi-block) requests finish sooner
+    static const DiskModel SSD;
+
+    // Return the named model, or NULL
+    static const DiskModel *find(const char *name);
+};
+
+// ModelDisk keeps its blocks in memory like RamDisk, and charges every
+// request to a simulated clock. Nothing sleeps, and the same requests always
+// cost the same time.
+class ModelDisk : public RamDisk {
+private:
+    DiskModel	Model;	    // Device being simulated
+    std::mutex	Lock;	    // Serializes requests, as the device would
+    double	Clock;	    // Simulated time spent so far (microseconds)
+    size_t	Head;	    // Block following the last request
+
+    // Advance the clock by the cost of a request
+    void charge(size_t blocknum, size_t nblocks);
+
+protected:
+    void read_blocks(size_t blocknum, size_t nblocks, char *data);
+    void write_blocks(size_t blocknum, size_t nblocks, char *data);
+
+public:
+    // Constructor
+    // @param	model	    Device to simulate
+    ModelDisk(const DiskModel &model) : Model(model), Clock(0), Head(0) {}
+
+    // Destructor (prints the simulated time)
+    ~ModelDisk();
+
+    // Return simulated time spent so far (in seconds)
+    double elapsed();
+};
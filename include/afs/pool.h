@@ -0,0 +1,72 @@
+// pool.h: Aligned block buffer pool
+
+#pragma once
+
+#include "afs/disk.h"
+
+#include <mutex>
+#include <vector>
+
+// BlockPool hands out block buffers aligned for O_DIRECT I/O. Buffers are
+// carved from arenas of ARENA_BLOCKS at a time and recycled through a free
+// list, so memory use stays at the peak number of buffers in use at once.
+class BlockPool {
+private:
+    std::mutex	Lock;		    // Guards the lists below
+    std::vector<char *> Arenas;	    // Every arena allocated so far
+    std::vector<char *> Free;	    // Buffers ready to hand out
+
+public:
+    // Buffer alignment: enough for O_DIRECT on any common device
+    const static size_t ALIGNMENT = 4096;
+
+    // Distance between buffers in an arena, so each one stays aligned
+    const static size_t STRIDE = Disk::BLOCK_SIZE > ALIGNMENT ? Disk::BLOCK_SIZE : ALIGNMENT;
+
+    // Buffers allocated at a time
+    const static size_t ARENA_BLOCKS = 16;
+
+    // Destructor (frees every arena; all buffers must have been released)
+    ~BlockPool();
+
+    // Borrow a buffer of Disk::BLOCK_SIZE bytes (its contents are undefined)
+    // Throws bad_alloc exception if no memory is left.
+    char *acquire();
+
+    // Return a buffer from acquire
+    void release(char *buffer);
+
+    // Return number of buffers allocated / currently borrowed
+    size_t allocated();
+    size_t borrowed();
+
+    // Return whether a pointer is suitably aligned for O_DIRECT
+    static bool aligned(const void *pointer) { return ((size_t)pointer & (ALIGNMENT - 1)) == 0; }
+
+    // Pool shared by every file system in the process
+    static BlockPool &shared();
+};
+
+// A buffer borrowed from the shared pool for as long as this object lives,
+// viewed as a T (a block sized union or struct).
+template <typename T>
+class Borrowed {
+private:
+    T *Buffer;
+
+public:
+    static_assert(sizeof(T) <= Disk::BLOCK_SIZE, "borrowed buffers hold one block");
+
+    Borrowed() : Buffer(reinterpret_cast<T *>(BlockPool::shared().acquire())) {}
+    Borrowed(Borrowed &&other) : Buffer(other.Buffer) { other.Buffer = NULL; }
+    Borrowed(const Borrowed &) = delete;
+    Borrowed &operator=(const Borrowed &) = delete;
+    ~Borrowed() {
+    	if (Buffer != NULL) {
+    	    BlockPool::shared().release(reinterpret_cast<char *>(Buffer));
+	}
+    }
+
+    T &operator*() const { return *Buffer; }
+    T *operator->() const { return Buffer; }
+};
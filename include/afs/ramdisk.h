@@ -0,0 +1,36 @@
+// ramdisk.h: In-memory disk
+
+#pragma once
+
+#include "afs/disk.h"
+
+#include <memory>
+#include <vector>
+
+// RamDisk keeps every block in memory, so tests and benchmarks pay no
+// system call or page cache costs. Blocks are allocated on first write and
+// freed on discard; blocks never written read back as zeros. Nothing is
+// written back to the host.
+class RamDisk : public Disk {
+private:
+    std::vector<std::unique_ptr<char[]>> Data;	// Contents of each written block
+
+protected:
+    void read_blocks(size_t blocknum, size_t nblocks, char *data);
+    void write_blocks(size_t blocknum, size_t nblocks, char *data);
+    bool discard_blocks(size_t blocknum, size_t nblocks);
+
+public:
+    // Open an empty (all zero) disk
+    // @param	nblocks	    Number of blocks in disk
+    void open(size_t nblocks);
+
+    // Open a disk holding a copy of an image file
+    // @param	path	    Path to disk image (its changes stay in memory)
+    // @param	nblocks	    Number of blocks in disk
+    // Throws runtime_error exception on error.
+    void load(const char *path, size_t nblocks);
+
+    // Return number of blocks holding data in memory
+    size_t resident() const;
+};
@@ -0,0 +1,36 @@
+// scan.h: Vectorized metadata scans
+
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Each scan uses AVX2 or SSE2 when the CPU supports it, and plain loops
+// otherwise; all of them give the same answers.
+
+// Return the index of the first zero / non-zero value, or count if none
+size_t scan_first_zero32(const uint32_t *values, size_t count);
+size_t scan_first_nonzero32(const uint32_t *values, size_t count);
+size_t scan_first_zero64(const uint64_t *values, size_t count);
+
+// Store the index of every non-zero value in positions (room for count
+// entries); returns the number stored
+size_t scan_nonzero32(const uint32_t *values, size_t count, uint32_t *positions);
+
+// Return the number of non-zero values
+size_t count_nonzero32(const uint32_t *values, size_t count);
+
+// Find valid inodes: records of stride words whose first word is non-zero
+// @param	words	    First word of the first record
+// @param	count	    Number of records
+// @param	stride	    Words per record (a power of two, at least 4)
+// @param	positions   Receives the index of each valid record
+// Returns the number of valid records.
+size_t scan_valid(const uint32_t *words, size_t count, size_t stride, uint32_t *positions);
+
+// Return the implementation in use: "avx2", "sse2" or "scalar"
+const char *scan_implementation();
+
+// Switch implementations (for benchmarks); returns false if the CPU does
+// not support the one named
+bool scan_select(const char *name);
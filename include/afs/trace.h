@@ -0,0 +1,60 @@
+// trace.h: Operation tracing
+
+#pragma once
+
+#include <atomic>
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+// Trace records a timed span for each file system call and each disk
+// transfer inside it. Spans go into a ring buffer owned by the thread that
+// made them, and are written out as Chrome trace JSON (for chrome://tracing
+// or Perfetto). When tracing is off a span costs one relaxed load.
+class Trace {
+public:
+    // Spans each thread keeps (older ones are overwritten)
+    const static size_t RING_EVENTS = 1 << 16;
+
+    // A span from construction to destruction, with one numeric argument.
+    // Names and keys must be string literals: only the pointers are kept.
+    class Span {
+    private:
+    	const char *Name;
+    	const char *Key;
+    	uint64_t    Value;
+    	uint64_t    Start;	    // 0 if tracing was off at construction
+
+    public:
+    	Span(const char *name, const char *key = NULL, uint64_t value = 0)
+    	    : Name(name), Key(key), Value(value), Start(enabled() ? now() : 0) {}
+    	Span(const Span &) = delete;
+    	Span &operator=(const Span &) = delete;
+    	~Span() {
+    	    if (Start != 0) {
+    	    	record(Name, Key, Value, Start);
+	    }
+	}
+    };
+
+    // Discard recorded spans and start / stop recording new ones
+    static void start();
+    static void stop();
+
+    static bool enabled() { return Enabled.load(std::memory_order_relaxed); }
+
+    // Write every recorded span to path as trace JSON; returns the number
+    // written, or -1. Call it while no spans are being recorded.
+    static ssize_t dump(const char *path);
+
+    // Number of spans overwritten before they could be dumped
+    static size_t dropped();
+
+private:
+    static std::atomic<bool> Enabled;
+
+    // Monotonic time in nanoseconds (never 0)
+    static uint64_t now();
+    static void record(const char *name, const char *key, uint64_t value, uint64_t start);
+};
@@ -0,0 +1,238 @@
+// afsbench.cpp: Sequential throughput and metadata overhead benchmark
+
+#include "afs/disk.h"
+#include "afs/fs.h"
+#include "afs/modeldisk.h"
+#include "afs/ramdisk.h"
+#include "afs/scan.h"
+
+#include <algorithm>
+#include <chrono>
+#include <memory>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+// Bytes handed to each read / write call
+const static size_t CHUNK_SIZE = 64*1024;
+
+// Mounts timed with each scan implementation
+const static int MOUNT_ROUNDS = 5;
+
+void usage(const char *program) {
+    fprintf(stderr, "Usage: %s [-b file|ram|hdd|ssd] [-d] [-m MiB] [-s stripe-blocks] [diskfile[,diskfile...]]\n", program);
+    fprintf(stderr, "    -b backend		Disk backend; only file needs a diskfile (default: file)\n");
+    fprintf(stderr, "    -d			Open images with O_DIRECT, bypassing the page cache\n");
+    fprintf(stderr, "    -m MiB		Amount of data to write and read back (default: 64)\n");
+    fprintf(stderr, "    -s stripe-blocks	Blocks per stripe unit across several images (default: %lu)\n", FileDisk::STRIPE_BLOCKS);
+}
+
+void unlink_all(const std::vector<std::string> &paths) {
+    for (size_t i = 0; i < paths.size(); i++) {
+    	unlink(paths[i].c_str());
+    }
+}
+
+double elapsed(std::chrono::steady_clock::time_point start) {
+    return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+}
+
+// Seconds spent since start: simulated time on a model disk, wall time
+// otherwise
+double elapsed(Disk &disk, std::chrono::steady_clock::time_point start, double simulated) {
+    ModelDisk *model = dynamic_cast<ModelDisk *>(&disk);
+    return model ? model->elapsed() - simulated : elapsed(start);
+}
+
+// CPU seconds used by the process so far
+double cpu_time() {
+    struct timespec now;
+    clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &now);
+    return now.tv_sec + now.tv_nsec / 1e9;
+}
+
+double simulated(Disk &disk) {
+    ModelDisk *model = dynamic_cast<ModelDisk *>(&disk);
+    return model ? model->elapsed() : 0;
+}
+
+// Main execution
+
+int main(int argc, char *argv[]) {
+    const char *backend = "file";
+    size_t total = 64;
+    size_t stripe_blocks = FileDisk::STRIPE_BLOCKS;
+    bool   direct = false;
+    int    c;
+
+    while ((c = getopt(argc, argv, "b:dm:s:h")) != -1) {
+    	switch (c) {
+    	    case 'b': backend = optarg; break;
+    	    case 'd': direct = true; break;
+    	    case 'm': total = atoi(optarg); break;
+    	    case 's': stripe_blocks = atoi(optarg); break;
+    	    default:
+    	    	usage(argv[0]);
+    	    	return c == 'h' ? EXIT_SUCCESS : EXIT_FAILURE;
+	}
+    }
+
+    const DiskModel *model = DiskModel::find(backend);
+    bool in_memory = model != NULL || strcmp(backend, "ram") == 0;
+    if (optind != argc - (in_memory ? 0 : 1) || total == 0 ||
+    	!(in_memory || strcmp(backend, "file") == 0)) {
+    	usage(argv[0]);
+    	return EXIT_FAILURE;
+    }
+    const char *path = in_memory ? backend : argv[optind];
+    total *= 1024*1024;
+
+    // Several comma separated images make a striped disk
+    std::vector<std::string> paths;
+    if (!in_memory) {
+    	std::stringstream path_list(path);
+    	std::string member;
+    	while (std::getline(path_list, member, ',')) {
+    	    paths.push_back(member);
+	}
+    }
+
+    // Files are as large as the inode allows, in whole chunks
+    size_t file_size   = (FileSystem::POINTERS_PER_INODE + FileSystem::POINTERS_PER_BLOCK)*Disk::BLOCK_SIZE / CHUNK_SIZE * CHUNK_SIZE;
+    file_size          = std::min(file_size, total);
+    size_t nfiles      = (total + file_size - 1) / file_size;
+    size_t file_blocks = file_size / Disk::BLOCK_SIZE;
+    size_t data_blocks = nfiles*file_blocks;
+
+    // Leave room for the inode table (10%), checksums and indirect blocks
+    size_t nblocks = (data_blocks + nfiles)*5/4 + 64;
+
+    std::unique_ptr<Disk> disk_pointer;
+    try {
+    	if (in_memory) {
+    	    RamDisk *ramdisk = model ? new ModelDisk(*model) : new RamDisk;
+    	    disk_pointer.reset(ramdisk);
+    	    ramdisk->open(nblocks);
+	} else {
+	    FileDisk *filedisk = new FileDisk;
+	    disk_pointer.reset(filedisk);
+	    filedisk->open(paths, nblocks, stripe_blocks, direct);
+	}
+    } catch (std::runtime_error &e) {
+    	fprintf(stderr, "Unable to open disk %s: %s\n", path, e.what());
+    	return EXIT_FAILURE;
+    }
+
+    Disk &disk = *disk_pointer;
+    FileSystem fs;
+    if (!fs.format(&disk) || !fs.mount(&disk)) {
+    	fprintf(stderr, "Unable to format disk %s\n", path);
+    	unlink_all(paths);
+    	return EXIT_FAILURE;
+    }
+
+    size_t reserved = 1 + fs.inodes()/FileSystem::INODES_PER_BLOCK +
+		      (nblocks + FileSystem::CHECKSUMS_PER_BLOCK - 1)/FileSystem::CHECKSUMS_PER_BLOCK;
+    printf("block size %lu: %lu MiB in %lu files of %lu blocks\n",
+	   Disk::BLOCK_SIZE, total/(1024*1024), nfiles, file_blocks);
+    if (paths.size() > 1) {
+    	printf("    striped across %lu images, %lu blocks per stripe unit\n", paths.size(), stripe_blocks);
+    }
+    if (direct) {
+    	printf("    O_DIRECT images\n");
+    }
+    if (in_memory) {
+    	printf("    %s disk%s\n", backend, model ? ", simulated throughput" : "");
+    }
+    printf("    format  %lu of %lu blocks reserved for metadata (%.2f%%)\n",
+	   reserved, nblocks, 100.0*reserved/nblocks);
+
+    std::vector<char> buffer(CHUNK_SIZE);
+    for (size_t i = 0; i < buffer.size(); i++) {
+    	buffer[i] = i*31 + 7;
+    }
+
+    // Sequential writes
+    std::vector<size_t> inumbers;
+    size_t writes = disk.writes();
+    double clock  = simulated(disk);
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    for (size_t f = 0; f < nfiles; f++) {
+    	size_t inumber = fs.create();
+    	int    handle  = fs.open(inumber);
+    	if (inumber == (size_t)-1 || handle < 0) {
+    	    fprintf(stderr, "Unable to create file %lu\n", f);
+    	    unlink_all(paths);
+    	    return EXIT_FAILURE;
+	}
+	for (size_t offset = 0; offset < file_size; offset += CHUNK_SIZE) {
+	    if (fs.write(handle, buffer.data(), CHUNK_SIZE) != CHUNK_SIZE) {
+	    	fprintf(stderr, "Unable to write file %lu at %lu\n", f, offset);
+	    	unlink_all(paths);
+	    	return EXIT_FAILURE;
+	    }
+	}
+	fs.close(handle);
+	inumbers.push_back(inumber);
+    }
+    double seconds = elapsed(disk, start, clock);
+    writes = disk.writes() - writes;
+    printf("    write   %8.1f MiB/s  %lu block writes, %lu for metadata (%.2f%%)\n",
+	   nfiles*file_size/seconds/(1024*1024), writes, writes - data_blocks,
+	   100.0*(writes - data_blocks)/writes);
+
+    // Sequential reads
+    size_t reads = disk.reads();
+    clock = simulated(disk);
+    start = std::chrono::steady_clock::now();
+    for (size_t f = 0; f < nfiles; f++) {
+    	int handle = fs.open(inumbers[f]);
+    	while ((ssize_t)fs.read(handle, buffer.data(), CHUNK_SIZE) > 0);
+    	fs.close(handle);
+    }
+    seconds = elapsed(disk, start, clock);
+    reads = disk.reads() - reads;
+    printf("    read    %8.1f MiB/s  %lu block reads, %lu for metadata (%.2f%%)\n",
+	   nfiles*file_size/seconds/(1024*1024), reads, reads - data_blocks,
+	   100.0*(reads - data_blocks)/reads);
+
+    // Mount CPU cost with each metadata scan implementation (best of a few
+    // mounts, so the inode table is in memory or the page cache)
+    const char *scanners[] = {"scalar", "sse2", "avx2"};
+    std::string scanner = scan_implementation();
+    printf("    mount  ");
+    for (size_t i = 0; i < sizeof(scanners)/sizeof(scanners[0]); i++) {
+    	if (!scan_select(scanners[i])) {
+    	    continue;
+	}
+	double best = 0;
+	for (int m = 0; m < MOUNT_ROUNDS; m++) {
+	    FileSystem remount;
+	    disk.unmount();
+	    double start = cpu_time();
+	    if (!remount.mount(&disk)) {
+	    	fprintf(stderr, "Unable to mount disk %s\n", path);
+	    	unlink_all(paths);
+	    	return EXIT_FAILURE;
+	    }
+	    double seconds = cpu_time() - start;
+	    best = m == 0 ? seconds : std::min(best, seconds);
+	}
+	printf(" %8.2f ms %s", best*1000, scanners[i]);
+    }
+    printf(" (CPU per mount, %lu free blocks)\n", fs.free_blocks());
+    scan_select(scanner.c_str());
+
+    printf("    pool    %lu block buffers allocated, %lu borrowed\n",
+	   BlockPool::shared().allocated(), BlockPool::shared().borrowed());
+
+    unlink_all(paths);
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,89 @@
+// afsck.cpp: File system consistency checker
+
+#include "afs/disk.h"
+#include "afs/fs.h"
+#include "afs/fsck.h"
+
+#include <stdexcept>
+#include <thread>
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+// Exit codes (as with fsck(8))
+
+#define AFSCK_OK	    0
+#define AFSCK_REPAIRED	    1
+#define AFSCK_UNCORRECTED   4
+#define AFSCK_FAILURE	    8
+
+void usage(const char *program) {
+    fprintf(stderr, "Usage: %s [-r] [-d] [-j threads] <diskfile>\n", program);
+    fprintf(stderr, "    -r		Repair problems found\n");
+    fprintf(stderr, "    -d		Verify data block checksums\n");
+    fprintf(stderr, "    -j threads	Number of scanning threads (default: number of cores)\n");
+}
+
+// Main execution
+
+int main(int argc, char *argv[]) {
+    bool   repair      = false;
+    bool   verify_data = false;
+    size_t threads     = std::thread::hardware_concurrency();
+    int    c;
+
+    while ((c = getopt(argc, argv, "rdj:h")) != -1) {
+    	switch (c) {
+    	    case 'r': repair = true; break;
+    	    case 'd': verify_data = true; break;
+    	    case 'j': threads = atoi(optarg); break;
+    	    default:
+    	    	usage(argv[0]);
+    	    	return c == 'h' ? AFSCK_OK : AFSCK_FAILURE;
+	}
+    }
+
+    if (optind != argc - 1) {
+    	usage(argv[0]);
+    	return AFSCK_FAILURE;
+    }
+
+    // Size the disk from the image, so opening it never resizes anything;
+    // a check without repair opens it read-only
+    const char *path = argv[optind];
+    struct stat st;
+    if (stat(path, &st) < 0) {
+    	fprintf(stderr, "Unable to stat %s: %s\n", path, strerror(errno));
+    	return AFSCK_FAILURE;
+    }
+    if (st.st_size % Disk::BLOCK_SIZE != 0) {
+    	fprintf(stderr, "Unable to check %s: %lu bytes is not a whole number of %lu byte blocks\n", path, (size_t)st.st_size, Disk::BLOCK_SIZE);
+    	return AFSCK_FAILURE;
+    }
+
+    FileDisk disk;
+    try {
+    	disk.open(path, st.st_size / Disk::BLOCK_SIZE, false, !repair);
+    } catch (std::runtime_error &e) {
+    	fprintf(stderr, "Unable to open disk %s: %s\n", path, e.what());
+    	return AFSCK_FAILURE;
+    }
+
+    FileSystemChecker::Report report;
+    try {
+    	FileSystemChecker checker(&disk, threads, repair, verify_data);
+    	report = checker.check();
+    } catch (std::exception &e) {
+    	fprintf(stderr, "Unable to check disk %s: %s\n", path, e.what());
+    	return AFSCK_FAILURE;
+    }
+
+    if (report.Errors == 0) {
+    	return AFSCK_OK;
+    }
+    return report.Errors == report.Repaired ? AFSCK_REPAIRED : AFSCK_UNCORRECTED;
+}
@@ -0,0 +1,166 @@
+// crc32c.cpp: CRC32C (Castagnoli) checksums
+
+#include "afs/crc32c.h"
+
+#include <string.h>
+
+#if defined(__x86_64__)
+#include <nmmintrin.h>
+#include <wmmintrin.h>
+#endif
+
+// Reflected CRC32C polynomial
+const static uint32_t CRC32C_POLY = 0x82f63b78;
+
+// Bytes per stream when checksumming three streams in parallel
+const static size_t CRC32C_LANE = 1360;
+
+// Internal state: slicing tables, lane shift constants, and implementation
+
+struct Crc32c {
+    uint32_t Table[8][256];
+    uint32_t Shift1;	    // x^(8*LANE-33)   mod P
+    uint32_t Shift2;	    // x^(16*LANE-33)  mod P
+    bool     Hardware;
+
+    Crc32c();
+};
+
+// Multiply register by x^bits modulo P (reflected domain)
+static uint32_t crc32c_xpow(uint32_t reg, size_t bits) {
+    for (size_t i = 0; i < bits; i++) {
+    	reg = (reg >> 1) ^ ((reg & 1) ? CRC32C_POLY : 0);
+    }
+    return reg;
+}
+
+Crc32c::Crc32c() {
+    for (uint32_t i = 0; i < 256; i++) {
+    	uint32_t reg = i;
+    	for (int j = 0; j < 8; j++) {
+    	    reg = (reg >> 1) ^ ((reg & 1) ? CRC32C_POLY : 0);
+	}
+	Table[0][i] = reg;
+    }
+    for (int k = 1; k < 8; k++) {
+    	for (uint32_t i = 0; i < 256; i++) {
+    	    Table[k][i] = (Table[k-1][i] >> 8) ^ Table[0][Table[k-1][i] & 0xff];
+	}
+    }
+
+    Shift1 = crc32c_xpow(0x80000000, 8*CRC32C_LANE - 33);
+    Shift2 = crc32c_xpow(0x80000000, 16*CRC32C_LANE - 33);
+
+#if defined(__x86_64__)
+    __builtin_cpu_init();
+    Hardware = __builtin_cpu_supports("sse4.2") && __builtin_cpu_supports("pclmul");
+#else
+    Hardware = false;
+#endif
+}
+
+static const Crc32c &crc32c_state() {
+    static const Crc32c State;
+    return State;
+}
+
+// Table-driven implementation -------------------------------------------------
+
+static uint32_t crc32c_sw(const Crc32c &s, uint32_t reg, const unsigned char *p, size_t n) {
+    while (n > 0 && ((uintptr_t)p & 7)) {
+    	reg = s.Table[0][(reg ^ *p++) & 0xff] ^ (reg >> 8);
+    	n--;
+    }
+
+    while (n >= 8) {
+    	uint64_t word;
+    	memcpy(&word, p, sizeof(word));
+    	word ^= reg;
+    	reg = s.Table[7][ word        & 0xff] ^ s.Table[6][(word >>  8) & 0xff] ^
+    	      s.Table[5][(word >> 16) & 0xff] ^ s.Table[4][(word >> 24) & 0xff] ^
+    	      s.Table[3][(word >> 32) & 0xff] ^ s.Table[2][(word >> 40) & 0xff] ^
+    	      s.Table[1][(word >> 48) & 0xff] ^ s.Table[0][ word >> 56        ];
+    	p += 8;
+    	n -= 8;
+    }
+
+    while (n-- > 0) {
+    	reg = s.Table[0][(reg ^ *p++) & 0xff] ^ (reg >> 8);
+    }
+    return reg;
+}
+
+// Hardware implementation -----------------------------------------------------
+
+#if defined(__x86_64__)
+__attribute__((target("sse4.2")))
+static uint32_t crc32c_hw_serial(uint32_t reg, const unsigned char *p, size_t n) {
+    uint64_t r = reg;
+
+    while (n > 0 && ((uintptr_t)p & 7)) {
+    	r = _mm_crc32_u8((uint32_t)r, *p++);
+    	n--;
+    }
+
+    while (n >= 8) {
+    	uint64_t word;
+    	memcpy(&word, p, sizeof(word));
+    	r = _mm_crc32_u64(r, word);
+    	p += 8;
+    	n -= 8;
+    }
+
+    while (n-- > 0) {
+    	r = _mm_crc32_u8((uint32_t)r, *p++);
+    }
+    return (uint32_t)r;
+}
+
+// Advance register over a run of zero bytes using a precomputed x^k constant
+__attribute__((target("sse4.2,pclmul")))
+static uint32_t crc32c_hw_shift(uint32_t reg, uint32_t constant) {
+    __m128i product = _mm_clmulepi64_si128(_mm_cvtsi32_si128(reg), _mm_cvtsi32_si128(constant), 0);
+    return (uint32_t)_mm_crc32_u64(0, (uint64_t)_mm_cvtsi128_si64(product));
+}
+
+// The crc32 instruction has a three cycle latency but single cycle throughput,
+// so run three independent streams and merge them with carry-less multiplies.
+__attribute__((target("sse4.2,pclmul")))
+static uint32_t crc32c_hw(const Crc32c &s, uint32_t reg, const unsigned char *p, size_t n) {
+    while (n >= 3*CRC32C_LANE) {
+    	uint64_t a = reg, b = 0, c = 0;
+    	for (size_t i = 0; i < CRC32C_LANE; i += 8) {
+    	    uint64_t wa, wb, wc;
+    	    memcpy(&wa, p + i, sizeof(wa));
+    	    memcpy(&wb, p + CRC32C_LANE + i, sizeof(wb));
+    	    memcpy(&wc, p + 2*CRC32C_LANE + i, sizeof(wc));
+    	    a = _mm_crc32_u64(a, wa);
+    	    b = _mm_crc32_u64(b, wb);
+    	    c = _mm_crc32_u64(c, wc);
+	}
+	reg = crc32c_hw_shift((uint32_t)a, s.Shift2) ^ crc32c_hw_shift((uint32_t)b, s.Shift1) ^ (uint32_t)c;
+	p += 3*CRC32C_LANE;
+	n -= 3*CRC32C_LANE;
+    }
+    return crc32c_hw_serial(reg, p, n);
+}
+#endif
+
+// Public interface ------------------------------------------------------------
+
+uint32_t crc32c(const void *data, size_t length, uint32_t crc) {
+    const Crc32c &s = crc32c_state();
+    const unsigned char *p = (const unsigned char *)data;
+    uint32_t reg = ~crc;
+
+#if defined(__x86_64__)
+    if (s.Hardware) {
+    	return ~crc32c_hw(s, reg, p, length);
+    }
+#endif
+    return ~crc32c_sw(s, reg, p, length);
+}
+
+bool crc32c_hardware() {
+    return crc32c_state().Hardware;
+}
@@ -1,53 +1,52 @@
 // disk.cpp: disk emulator
 
 #include "afs/disk.h"
+#include "afs/pool.h"
+#include "afs/trace.h"
 
+#include <algorithm>
+#include <memory>
 #include <stdexcept>
+#include <sys/stat.h>
 #include <sys/types.h>
+#include <sys/uio.h>
 
 #include <errno.h>
 #include <fcntl.h>
+#include <limits.h>
 #include <string.h>
 #include <unistd.h>
 
-void Disk::open(const char *path, size_t nblocks) {
-    FileDescriptor = ::open(path, O_RDWR|O_CREAT, 0600);
-    if (FileDescriptor < 0) {
-    	char what[BUFSIZ];
-    	snprintf(what, BUFSIZ, "Unable to open %s: %s", path, strerror(errno));
-    	throw std::runtime_error(what);
-    }
-
-    if (ftruncate(FileDescriptor, nblocks*BLOCK_SIZE) < 0) {
-    	char what[BUFSIZ];
-    	snprintf(what, BUFSIZ, "Unable to open %s: %s", path, strerror(errno));
-    	throw std::runtime_error(what);
-    }
+// Disk -----------------------------------------------------------------------
 
-    Blocks = nblocks;
-    Reads  = 0;
-    Writes = 0;
+void Disk::opened(size_t nblocks) {
+    Blocks   = nblocks;
+    Reads    = 0;
+    Writes   = 0;
+    Discards = 0;
+    Opened   = true;
 }
 
 Disk::~Disk() {
-    if (FileDescriptor > 0) {
-    	printf("%lu disk block reads\n", Reads);
-    	printf("%lu disk block writes\n", Writes);
-    	close(FileDescriptor);
-    	FileDescriptor = 0;
+    if (Opened) {
+    	printf("%lu disk block reads\n", Reads.load());
+    	printf("%lu disk block writes\n", Writes.load());
+    	if (Discards > 0) {
+    	    printf("%lu disk block discards\n", Discards.load());
+	}
     }
 }
 
-void Disk::sanity_check(int blocknum, char *data) {
+void Disk::sanity_check(size_t blocknum, size_t nblocks, char *data) {
     char what[BUFSIZ];
 
-    if (blocknum < 0) {
-    	snprintf(what, BUFSIZ, "blocknum (%d) is negative!", blocknum);
+    if (blocknum >= Blocks) {
+    	snprintf(what, BUFSIZ, "blocknum (%lu) is too big!", blocknum);
     	throw std::invalid_argument(what);
     }
 
-    if (blocknum >= (int)Blocks) {
-    	snprintf(what, BUFSIZ, "blocknum (%d) is too big!", blocknum);
+    if (nblocks > Blocks - blocknum) {
+    	snprintf(what, BUFSIZ, "%lu blocks at %lu is out of range!", nblocks, blocknum);
     	throw std::invalid_argument(what);
     }
 
@@ -57,38 +56,352 @@ void Disk::sanity_check(int blocknum, char *data) {
     }
 }
 
-void Disk::read(int blocknum, char *data) {
-    sanity_check(blocknum, data);
+void Disk::read(size_t blocknum, char *data) {
+    Trace::Span span("disk read", "block", blocknum);
+    sanity_check(blocknum, 1, data);
+    read_blocks(blocknum, 1, data);
+    Reads++;
+}
+
+void Disk::read(size_t blocknum, size_t nblocks, char *data) {
+    Trace::Span span("disk read", "blocks", nblocks);
+    sanity_check(blocknum, nblocks, data);
+    read_blocks(blocknum, nblocks, data);
+    Reads += nblocks;
+}
+
+void Disk::write(size_t blocknum, char *data) {
+    Trace::Span span("disk write", "block", blocknum);
+    sanity_check(blocknum, 1, data);
+    write_blocks(blocknum, 1, data);
+    Writes++;
+}
+
+void Disk::write(size_t blocknum, size_t nblocks, char *data) {
+    Trace::Span span("disk write", "blocks", nblocks);
+    sanity_check(blocknum, nblocks, data);
+    write_blocks(blocknum, nblocks, data);
+    Writes += nblocks;
+}
 
-    if (lseek(FileDescriptor, blocknum*BLOCK_SIZE, SEEK_SET) < 0) {
+bool Disk::discard(size_t blocknum, size_t nblocks) {
+    Trace::Span span("disk discard", "blocks", nblocks);
+    if (blocknum > Blocks || nblocks > Blocks - blocknum) {
     	char what[BUFSIZ];
-    	snprintf(what, BUFSIZ, "Unable to lseek %d: %s", blocknum, strerror(errno));
-    	throw std::runtime_error(what);
+    	snprintf(what, BUFSIZ, "discard of %lu blocks at %lu is out of range!", nblocks, blocknum);
+    	throw std::invalid_argument(what);
     }
 
-    if (::read(FileDescriptor, data, BLOCK_SIZE) != BLOCK_SIZE) {
-    	char what[BUFSIZ];
-    	snprintf(what, BUFSIZ, "Unable to read %d: %s", blocknum, strerror(errno));
-    	throw std::runtime_error(what);
+    if (!discard_blocks(blocknum, nblocks)) {
+    	return false;
     }
 
-    Reads++;
+    Discards += nblocks;
+    return true;
 }
 
-void Disk::write(int blocknum, char *data) {
-    sanity_check(blocknum, data);
+// FileDisk -------------------------------------------------------------------
 
-    if (lseek(FileDescriptor, blocknum*BLOCK_SIZE, SEEK_SET) < 0) {
-    	char what[BUFSIZ];
-    	snprintf(what, BUFSIZ, "Unable to lseek %d: %s", blocknum, strerror(errno));
-    	throw std::runtime_error(what);
+void FileDisk::open(const char *path, size_t nblocks, bool direct, bool read_only) {
+    std::vector<std::string> paths(1, path);
+    open(paths, nblocks, STRIPE_BLOCKS, direct, read_only);
+}
+
+void FileDisk::open(const std::vector<std::string> &paths, size_t nblocks, size_t stripe_blocks, bool direct, bool read_only) {
+    if (paths.empty() || stripe_blocks == 0) {
+    	throw std::runtime_error("Unable to open a disk with no images or an empty stripe unit");
     }
 
-    if (::write(FileDescriptor, data, BLOCK_SIZE) != BLOCK_SIZE) {
-    	char what[BUFSIZ];
-    	snprintf(what, BUFSIZ, "Unable to write %d: %s", blocknum, strerror(errno));
-    	throw std::runtime_error(what);
+    // Each member holds every paths.size()-th stripe unit
+    size_t stripe_width = stripe_blocks*paths.size();
+    size_t member_blocks = paths.size() == 1 ? nblocks : (nblocks + stripe_width - 1) / stripe_width * stripe_blocks;
+
+    // A read-only image is never resized, so it must already be big enough
+    for (size_t m = 0; m < paths.size(); m++) {
+    	int fd = ::open(paths[m].c_str(), (read_only ? O_RDONLY : O_RDWR|O_CREAT)|(direct ? O_DIRECT : 0), 0600);
+    	struct stat st;
+    	if (fd >= 0 && read_only && fstat(fd, &st) == 0 && (size_t)st.st_size < member_blocks*BLOCK_SIZE) {
+    	    close(fd);
+    	    fd = -1;
+    	    errno = EINVAL;
+	}
+    	if (fd < 0 || (!read_only && ftruncate(fd, member_blocks*BLOCK_SIZE) < 0)) {
+    	    char what[BUFSIZ];
+    	    snprintf(what, BUFSIZ, "Unable to open %s: %s", paths[m].c_str(), strerror(errno));
+    	    if (fd >= 0) {
+    	    	close(fd);
+	    }
+    	    throw std::runtime_error(what);
+	}
+	FileDescriptors.push_back(fd);
     }
 
-    Writes++;
+    StripeBlocks = stripe_blocks;
+    Direct       = direct;
+
+    // The first member of a transfer is issued by the caller; the others
+    // by their own threads, kept for the life of the disk
+    Workers.resize(paths.size());
+    for (size_t m = 1; m < paths.size(); m++) {
+    	Workers[m].reset(new Worker());
+    	Workers[m]->Thread = std::thread(&FileDisk::work, this, m);
+    }
+    opened(nblocks);
+}
+
+FileDisk::~FileDisk() {
+    {
+    	std::lock_guard<std::mutex> guard(Lock);
+    	Stopping = true;
+    }
+    for (size_t m = 0; m < Workers.size(); m++) {
+    	if (Workers[m]) {
+    	    Workers[m]->Queued.notify_one();
+    	    Workers[m]->Thread.join();
+	}
+    }
+
+    for (size_t m = 0; m < FileDescriptors.size(); m++) {
+    	close(FileDescriptors[m]);
+    }
+}
+
+void FileDisk::locate(size_t blocknum, size_t &member, off_t &offset) const {
+    if (FileDescriptors.size() == 1) {
+    	member = 0;
+    	offset = (off_t)blocknum*BLOCK_SIZE;
+    	return;
+    }
+
+    size_t stripe = blocknum / StripeBlocks;
+    member = stripe % FileDescriptors.size();
+    offset = (off_t)((stripe / FileDescriptors.size())*StripeBlocks + blocknum % StripeBlocks)*BLOCK_SIZE;
+}
+
+// Read or write every byte of iov, moving on past whatever a short transfer
+// did; returns 0, or an errno value (EIO if the image ends first)
+static int transfer_fully(int fd, struct iovec *iov, size_t iovcnt, off_t offset, bool write) {
+    while (iovcnt > 0) {
+    	int	count  = std::min(iovcnt, (size_t)IOV_MAX);
+    	ssize_t result = write ? ::pwritev(fd, iov, count, offset) : ::preadv(fd, iov, count, offset);
+    	if (result < 0 && errno == EINTR) {
+    	    continue;
+	}
+	if (result <= 0) {
+	    return result < 0 ? errno : EIO;
+	}
+
+	offset += result;
+	while (iovcnt > 0 && (size_t)result >= iov->iov_len) {
+	    result -= iov->iov_len;
+	    iov++;
+	    iovcnt--;
+	}
+	if (result > 0) {
+	    iov->iov_base = (char *)iov->iov_base + result;
+	    iov->iov_len -= result;
+	}
+    }
+    return 0;
+}
+
+void FileDisk::issue(size_t member, Request &request) {
+    Trace::Span span(request.Write ? "member write" : "member read", "member", member);
+    request.Error = transfer_fully(FileDescriptors[member], request.Iovecs.data(), request.Iovecs.size(), request.Offset, request.Write);
+}
+
+void FileDisk::work(size_t member) {
+    Worker &worker = *Workers[member];
+    std::unique_lock<std::mutex> guard(Lock);
+
+    while (true) {
+    	worker.Queued.wait(guard, [&] { return Stopping || !worker.Queue.empty(); });
+    	if (worker.Queue.empty()) {
+    	    return;
+	}
+	Request *request = worker.Queue.front();
+	worker.Queue.pop_front();
+
+	guard.unlock();
+	issue(member, *request);
+	guard.lock();
+	request->Done = true;
+	Finished.notify_all();
+    }
+}
+
+void FileDisk::transfer(size_t blocknum, size_t nblocks, char *data, bool write) {
+    if (nblocks == 0) {
+    	return;
+    }
+
+    // Consecutive stripe units on one member are adjacent in its image, so
+    // each member sees a single request, gathered from across the buffer
+    size_t members = FileDescriptors.size();
+    std::vector<Request> requests(members);
+    for (size_t b = blocknum; b < blocknum + nblocks; ) {
+    	size_t count = members == 1 ? nblocks : std::min(blocknum + nblocks - b, StripeBlocks - b % StripeBlocks);
+    	size_t member;
+    	off_t  offset;
+    	locate(b, member, offset);
+    	if (requests[member].Iovecs.empty()) {
+    	    requests[member].Offset = offset;
+	}
+	struct iovec iov = {data + (b - blocknum)*BLOCK_SIZE, count*BLOCK_SIZE};
+	requests[member].Iovecs.push_back(iov);
+	b += count;
+    }
+
+    // Every member but the first goes to its worker
+    size_t first = members;
+    {
+    	std::lock_guard<std::mutex> guard(Lock);
+    	for (size_t m = 0; m < members; m++) {
+    	    requests[m].Write = write;
+    	    requests[m].Error = 0;
+    	    requests[m].Done  = false;
+    	    if (requests[m].Iovecs.empty()) {
+    	    	continue;
+	    }
+	    if (first == members) {
+	    	first = m;
+	    } else {
+	    	Workers[m]->Queue.push_back(&requests[m]);
+	    	Workers[m]->Queued.notify_one();
+	    }
+	}
+    }
+
+    issue(first, requests[first]);
+    {
+    	std::unique_lock<std::mutex> guard(Lock);
+    	for (size_t m = first + 1; m < members; m++) {
+    	    if (!requests[m].Iovecs.empty()) {
+    	    	Finished.wait(guard, [&] { return requests[m].Done; });
+	    }
+	}
+    }
+
+    for (size_t m = 0; m < members; m++) {
+    	if (requests[m].Error != 0) {
+    	    char what[BUFSIZ];
+    	    snprintf(what, BUFSIZ, "Unable to %s %lu: %s", write ? "write" : "read", blocknum, strerror(requests[m].Error));
+    	    throw std::runtime_error(what);
+	}
+    }
+}
+
+static void release_buffer(void *buffer) {
+    BlockPool::shared().release((char *)buffer);
+}
+
+void FileDisk::bounce(size_t blocknum, size_t nblocks, char *data, bool write) {
+    // Single blocks borrow a pool buffer; longer requests (straight from a
+    // caller's buffer) get an aligned copy of their own
+    std::unique_ptr<char, void (*)(void *)> buffer(NULL, free);
+    if (nblocks == 1) {
+    	buffer = std::unique_ptr<char, void (*)(void *)>(BlockPool::shared().acquire(), release_buffer);
+    } else {
+    	void *memory;
+    	if (posix_memalign(&memory, BlockPool::ALIGNMENT, nblocks*BLOCK_SIZE) != 0) {
+    	    throw std::bad_alloc();
+	}
+	buffer.reset((char *)memory);
+    }
+
+    if (write) {
+    	memcpy(buffer.get(), data, nblocks*BLOCK_SIZE);
+    	write_blocks(blocknum, nblocks, buffer.get());
+    } else {
+    	read_blocks(blocknum, nblocks, buffer.get());
+    	memcpy(data, buffer.get(), nblocks*BLOCK_SIZE);
+    }
+}
+
+void FileDisk::read_blocks(size_t blocknum, size_t nblocks, char *data) {
+    if (Direct && !BlockPool::aligned(data)) {
+    	bounce(blocknum, nblocks, data, false);
+    	return;
+    }
+
+    if (nblocks == 1) {
+    	size_t member;
+    	off_t  offset;
+    	locate(blocknum, member, offset);
+    	struct iovec iov = {data, BLOCK_SIZE};
+    	int error = transfer_fully(FileDescriptors[member], &iov, 1, offset, false);
+    	if (error != 0) {
+    	    char what[BUFSIZ];
+    	    snprintf(what, BUFSIZ, "Unable to read %lu: %s", blocknum, strerror(error));
+    	    throw std::runtime_error(what);
+	}
+	return;
+    }
+
+    transfer(blocknum, nblocks, data, false);
+}
+
+void FileDisk::write_blocks(size_t blocknum, size_t nblocks, char *data) {
+    if (Direct && !BlockPool::aligned(data)) {
+    	bounce(blocknum, nblocks, data, true);
+    	return;
+    }
+
+    if (nblocks == 1) {
+    	size_t member;
+    	off_t  offset;
+    	locate(blocknum, member, offset);
+    	struct iovec iov = {data, BLOCK_SIZE};
+    	int error = transfer_fully(FileDescriptors[member], &iov, 1, offset, true);
+    	if (error != 0) {
+    	    char what[BUFSIZ];
+    	    snprintf(what, BUFSIZ, "Unable to write %lu: %s", blocknum, strerror(error));
+    	    throw std::runtime_error(what);
+	}
+	return;
+    }
+
+    transfer(blocknum, nblocks, data, true);
+}
+
+bool FileDisk::discard_blocks(size_t blocknum, size_t nblocks) {
+    char what[BUFSIZ];
+
+    // As with transfer, each member's share of the range is contiguous: it
+    // runs from the member's first block in the range to its last, and both
+    // lie within one stripe width of either end.
+    size_t members = FileDescriptors.size();
+    size_t stripe_width = members == 1 ? 1 : StripeBlocks*members;
+    std::vector<off_t> offsets(members, -1), lengths(members, 0);
+    for (size_t b = blocknum; b < blocknum + std::min(nblocks, stripe_width); b++) {
+    	size_t member;
+    	off_t  offset;
+    	locate(b, member, offset);
+    	if (offsets[member] < 0) {
+    	    offsets[member] = offset;
+	}
+    }
+    for (size_t b = blocknum + nblocks; b > blocknum + nblocks - std::min(nblocks, stripe_width); b--) {
+    	size_t member;
+    	off_t  offset;
+    	locate(b - 1, member, offset);
+    	if (lengths[member] == 0) {
+    	    lengths[member] = offset + BLOCK_SIZE - offsets[member];
+	}
+    }
+
+    for (size_t m = 0; m < members; m++) {
+    	if (lengths[m] == 0) {
+    	    continue;
+	}
+	if (fallocate(FileDescriptors[m], FALLOC_FL_PUNCH_HOLE|FALLOC_FL_KEEP_SIZE, offsets[m], lengths[m]) < 0) {
+	    if (errno == EOPNOTSUPP || errno == ENOSYS) {
+	    	return false;
+	    }
+	    snprintf(what, BUFSIZ, "Unable to discard %lu: %s", blocknum, strerror(errno));
+	    throw std::runtime_error(what);
+	}
+    }
+
+    return true;
 }
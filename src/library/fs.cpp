@@ -1,6 +1,9 @@
 // fs.cpp: File System
 
 #include "afs/fs.h"
+#include "afs/crc32c.h"
+#include "afs/scan.h"
+#include "afs/trace.h"
 
 #include <algorithm>
 
@@ -10,137 +13,633 @@
 #include <iostream>
 #include <fstream>
 
-int FileSystem::get_data_addrs(size_t inumber, int *tmp_array){
-    int tmp_addr;
+FileSystem::~FileSystem() {
+    if (FS_Disk != NULL) {
+        for(std::map<size_t, OpenInode>::iterator it = FS_Open_Inodes.begin(); it != FS_Open_Inodes.end(); it++){
+            flush_inode(it->first, it->second);
+        }
+        flush_metadata();
+    }
+    delete [] FS_Bitmap;
+}
 
-    int tmp_index = load_inode_block(inumber, false);
-    for(int i = 0; i < 1029; i++){
-        tmp_array[i] = 0;
+// On-disk formats --------------------------------------------------------------
+
+// Fill in the layout described by a superblock; returns whether its magic
+// number is valid. Unknown superblocks are read as version 1, for debug.
+// Images with the original version 1 magic number never defined the bytes
+// after Inodes, so those have no checksums and the legacy block size.
+bool FileSystem::read_geometry(const Block &block, Geometry &geometry){
+    if(block.SuperV2.MagicNumber == MAGIC_NUMBER_V2){
+        geometry.Version = 2;
+        geometry.BlockSize = block.SuperV2.BlockSize;
+        geometry.Blocks = block.SuperV2.Blocks;
+        geometry.InodeBlocks = block.SuperV2.InodeBlocks;
+        geometry.Inodes = block.SuperV2.Inodes;
+        geometry.ChecksumBlocks = block.SuperV2.ChecksumBlocks;
+        geometry.RefcountBlocks = block.SuperV2.RefcountBlocks;
+        geometry.InodesPerBlock = INODES_PER_BLOCK_V2;
+        geometry.PointersPerBlock = POINTERS_PER_BLOCK_V2;
+        return true;
     }
 
-    for(int i = 0; i < 5; i++){
-        tmp_addr = FS_Inode_Block.Inodes[tmp_index].Direct[i];
-        tmp_array[i] = tmp_addr;
+    geometry.Version = 1;
+    geometry.BlockSize = Disk::LEGACY_BLOCK_SIZE;
+    geometry.Blocks = block.Super.Blocks;
+    geometry.InodeBlocks = block.Super.InodeBlocks;
+    geometry.Inodes = block.Super.Inodes;
+    geometry.ChecksumBlocks = 0;
+    geometry.RefcountBlocks = 0;
+    geometry.InodesPerBlock = INODES_PER_BLOCK;
+    geometry.PointersPerBlock = POINTERS_PER_BLOCK;
+    if(block.Super.MagicNumber == MAGIC_NUMBER_EXT){
+        geometry.BlockSize = block.Super.BlockSize;
+        geometry.ChecksumBlocks = block.Super.ChecksumBlocks;
+        return true;
+    }
+    return block.Super.MagicNumber == MAGIC_NUMBER;
+}
 
+void FileSystem::decode_inode(const Geometry &geometry, const Block &block, size_t index, InodeV2 &inode){
+    if(geometry.Version == 2){
+        inode = block.InodesV2[index];
+        return;
     }
 
-    if(FS_Inode_Block.Inodes[tmp_index].Valid == false){
-        return 0;
+    const Inode &tmp_inode = block.Inodes[index];
+    inode.Valid = tmp_inode.Valid;
+    inode.Levels = 0;
+    inode.Size = tmp_inode.Size;
+    for(uint32_t i = 0; i < POINTERS_PER_INODE; i++){
+        inode.Direct[i] = tmp_inode.Direct[i];
     }
-    uint32_t indirect_add = FS_Inode_Block.Inodes[tmp_index].Indirect;
-    if((indirect_add == 0) || (indirect_add > FS_Blocks)){
-        return 0;
+    inode.Indirect = tmp_inode.Indirect;
+}
+
+void FileSystem::encode_inode(const Geometry &geometry, Block &block, size_t index, const InodeV2 &inode){
+    if(geometry.Version == 2){
+        block.InodesV2[index] = inode;
+        return;
+    }
+
+    Inode &tmp_inode = block.Inodes[index];
+    tmp_inode.Valid = inode.Valid;
+    tmp_inode.Size = inode.Size;
+    for(uint32_t i = 0; i < POINTERS_PER_INODE; i++){
+        tmp_inode.Direct[i] = inode.Direct[i];
+    }
+    tmp_inode.Indirect = inode.Indirect;
+}
+
+uint64_t FileSystem::get_pointer(const Geometry &geometry, const Block &block, size_t index){
+    return geometry.Version == 2 ? block.PointersV2[index] : block.Pointers[index];
+}
+
+void FileSystem::set_pointer(const Geometry &geometry, Block &block, size_t index, uint64_t blocknum){
+    if(geometry.Version == 2){
+        block.PointersV2[index] = blocknum;
+    } else {
+        block.Pointers[index] = blocknum;
+    }
+}
+
+// Checksummed block I/O -------------------------------------------------------
+
+uint32_t FileSystem::block_checksum(const char *data){
+    uint32_t crc = crc32c(data, Disk::BLOCK_SIZE);
+    // 0 is reserved for "no checksum recorded"
+    return crc ? crc : 1;
+}
+
+uint32_t *FileSystem::checksum_entry(size_t blocknum){
+    size_t checksum_start = FS_Geometry.InodeBlocks + 1;
+
+    if(FS_Geometry.ChecksumBlocks == 0 || blocknum == 0){
+        return NULL;
+    }
+    if(blocknum >= checksum_start && blocknum < checksum_start + FS_Geometry.ChecksumBlocks){
+        return NULL;
+    }
+
+    // Keep one checksum block cached, so sequential I/O within the same
+    // extent of CHECKSUMS_PER_BLOCK blocks only loads and flushes it once.
+    size_t tmp_checksum_block = checksum_start + blocknum / CHECKSUMS_PER_BLOCK;
+    if(tmp_checksum_block != current_checksum_block){
+        flush_checksums();
+        FS_Disk->read(tmp_checksum_block, FS_Checksum_Block->Data);
+        current_checksum_block = tmp_checksum_block;
+    }
+
+    return &FS_Checksum_Block->Checksums[blocknum % CHECKSUMS_PER_BLOCK];
+}
+
+void FileSystem::flush_checksums(){
+    if(checksum_dirty){
+        FS_Disk->write(current_checksum_block, FS_Checksum_Block->Data);
+        checksum_dirty = false;
+    }
+}
+
+bool FileSystem::read_block(size_t blocknum, char *data){
+    FS_Disk->read(blocknum, data);
+
+    uint32_t *entry = checksum_entry(blocknum);
+    if(entry == NULL || *entry == 0){
+        return true;
+    }
+    if(*entry != block_checksum(data)){
+        Checksum_Errors++;
+        fprintf(stderr, "checksum mismatch on block %lu\n", blocknum);
+        return false;
     }
-    FS_Bitmap[indirect_add] = 1;
-    Block indirectBlock;
+    return true;
+}
 
-    FS_Disk->read(indirect_add, indirectBlock.Data);
-    for(uint32_t i = 0; i < POINTERS_PER_BLOCK; i++){
-        tmp_addr = indirectBlock.Pointers[i];
-        tmp_array[5+i] = tmp_addr;
+void FileSystem::write_block(size_t blocknum, char *data){
+    uint32_t *entry = checksum_entry(blocknum);
+    if(entry != NULL){
+        *entry = block_checksum(data);
+        checksum_dirty = true;
+    }
+
+    FS_Disk->write(blocknum, data);
+}
+
+// Runs of consecutive blocks go to the disk as one request, which a striped
+// disk splits across its members
+size_t FileSystem::read_blocks(size_t blocknum, size_t nblocks, char *data){
+    FS_Disk->read(blocknum, nblocks, data);
+
+    size_t valid = nblocks;
+    for(size_t i = 0; i < nblocks; i++){
+        uint32_t *entry = checksum_entry(blocknum + i);
+        if(entry != NULL && *entry != 0 && *entry != block_checksum(data + i*Disk::BLOCK_SIZE)){
+            Checksum_Errors++;
+            fprintf(stderr, "checksum mismatch on block %lu\n", blocknum + i);
+            valid = std::min(valid, i);
+        }
+    }
+    return valid;
+}
+
+void FileSystem::write_blocks(size_t blocknum, size_t nblocks, char *data){
+    for(size_t i = 0; i < nblocks; i++){
+        uint32_t *entry = checksum_entry(blocknum + i);
+        if(entry != NULL){
+            *entry = block_checksum(data + i*Disk::BLOCK_SIZE);
+            checksum_dirty = true;
+        }
+    }
+
+    FS_Disk->write(blocknum, nblocks, data);
+}
+
+// Block reference counts -------------------------------------------------------
+
+uint32_t *FileSystem::refcount_entry(size_t blocknum, bool dirty){
+    size_t table_block = 1 + FS_Geometry.InodeBlocks + FS_Geometry.ChecksumBlocks + blocknum / REFCOUNTS_PER_BLOCK;
+
+    // Direct mapped, so a scan through the table only evicts blocks it is done with
+    RefcountBlock &cached = FS_Refcount_Cache[table_block % REFCOUNT_CACHE_BLOCKS];
+    if(cached.Blocknum != table_block){
+        if(cached.Dirty){
+            write_block(cached.Blocknum, cached.Data->Data);
+        }
+        read_block(table_block, cached.Data->Data);
+        cached.Blocknum = table_block;
+        cached.Dirty = false;
+    }
+
+    cached.Dirty = cached.Dirty || dirty;
+    return &cached.Data->Refcounts[blocknum % REFCOUNTS_PER_BLOCK];
+}
+
+uint32_t FileSystem::refcount(size_t blocknum){
+    if(FS_Bitmap != NULL){
+        return FS_Bitmap[blocknum];
+    }
+    return *refcount_entry(blocknum, false);
+}
+
+void FileSystem::set_refcount(size_t blocknum, uint32_t count){
+    if(FS_Bitmap != NULL){
+        FS_Bitmap[blocknum] = count;
+    } else {
+        *refcount_entry(blocknum, true) = count;
+    }
+
+    if(count == 0 && blocknum < FS_Free_Hint){
+        FS_Free_Hint = blocknum;
+    }
+}
+
+void FileSystem::flush_refcounts(){
+    for(size_t i = 0; i < FS_Refcount_Cache.size(); i++){
+        if(FS_Refcount_Cache[i].Dirty){
+            write_block(FS_Refcount_Cache[i].Blocknum, FS_Refcount_Cache[i].Data->Data);
+            FS_Refcount_Cache[i].Dirty = false;
+        }
+    }
+}
+
+// Reference count blocks are checksummed, so they go out before the checksums
+void FileSystem::flush_metadata(){
+    flush_refcounts();
+    flush_checksums();
+}
+
+// Block lists -----------------------------------------------------------------
+
+bool FileSystem::get_data_addrs(const InodeV2 &inode, std::vector<size_t> &addrs, PointerTree *tree){
+    addrs.clear();
+    if(tree != NULL){
+        tree->clear();
+    }
+
+    for(uint32_t i = 0; i < POINTERS_PER_INODE; i++){
+        if(inode.Direct[i] == 0){
+            return true;
+        }
+        addrs.push_back(inode.Direct[i]);
+    }
+
+    if((inode.Indirect == 0) || (inode.Indirect >= FS_Geometry.Blocks)){
+        return true;
+    }
+    if(indirect_levels(inode) > max_indirect_levels(FS_Geometry)){
+        return false;
+    }
+    return read_pointers(inode.Indirect, 0, indirect_levels(inode), addrs, tree);
+}
+
+// Add the pointers under one pointer block to addrs, stopping at the first
+// empty one; false if a block failed its checksum. A subtree that is not
+// full holds the end of the file, so nothing after it is read.
+bool FileSystem::read_pointers(size_t blocknum, size_t level, size_t levels, std::vector<size_t> &addrs, PointerTree *tree){
+    if(tree != NULL){
+        tree->resize(std::max(tree->size(), level + 1));
+        (*tree)[level].push_back(blocknum);
+    }
+
+    // Entries each pointer in this block leads to
+    size_t span = 1;
+    for(size_t l = level + 1; l < levels; l++){
+        span *= FS_Geometry.PointersPerBlock;
+    }
+
+    Borrowed<Block> pointerBlock;
+    bool valid = read_block(blocknum, pointerBlock->Data);
+    for(size_t i = 0; i < FS_Geometry.PointersPerBlock; i++){
+        uint64_t tmp_addr = get_pointer(FS_Geometry, *pointerBlock, i);
         if(tmp_addr == 0){
-            return 0;
+            return valid;
+        }
+        if(level + 1 == levels){
+            addrs.push_back(tmp_addr);
+            continue;
         }
 
+        size_t before = addrs.size();
+        if(tmp_addr >= FS_Geometry.Blocks || !read_pointers(tmp_addr, level + 1, levels, addrs, tree)){
+            return false;
+        }
+        if(addrs.size() - before < span){
+            break;
+        }
     }
+    return valid;
+}
 
-    return 0;
+// Allocate the pointer blocks needed to hold entries pointers past the
+// direct ones; false if the disk is full. A taller tree keeps the old one as
+// the first child of a new root, so no existing pointer moves.
+bool FileSystem::grow_tree(PointerTree &tree, size_t entries){
+    size_t levels = 0;
+    for(size_t capacity = 1; capacity < entries || levels == 0; capacity *= FS_Geometry.PointersPerBlock){
+        levels++;
+    }
+    if(entries == 0 || levels > max_indirect_levels(FS_Geometry)){
+        return entries == 0;
+    }
+
+    while(tree.size() < levels){
+        size_t root = find_free();
+        if(root == (size_t)-1){
+            return false;
+        }
+        set_refcount(root, 1);
+        tree.insert(tree.begin(), std::vector<size_t>(1, root));
+    }
+
+    size_t span = 1;
+    for(size_t level = tree.size(); level-- > 0;){
+        span *= FS_Geometry.PointersPerBlock;
+        while(tree[level].size() * span < entries){
+            size_t blocknum = find_free();
+            if(blocknum == (size_t)-1){
+                return false;
+            }
+            set_refcount(blocknum, 1);
+            tree[level].push_back(blocknum);
+        }
+    }
+    return true;
 }
 
+void FileSystem::release_tree(const PointerTree &tree){
+    for(size_t level = 0; level < tree.size(); level++){
+        for(size_t k = 0; k < tree[level].size(); k++){
+            release_block(tree[level][k]);
+        }
+    }
+}
+
+// Point an inode at a list of data blocks held by tree (see grow_tree). Only
+// the pointer blocks covering entries [dirty_from, dirty_to) are rewritten.
+bool FileSystem::set_data_addrs(InodeV2 &inode, const std::vector<size_t> &addrs, const PointerTree &tree, size_t dirty_from, size_t dirty_to){
+    if(addrs.size() > max_file_blocks()){
+        return false;
+    }
+
+    for(uint32_t i = 0; i < POINTERS_PER_INODE; i++){
+        inode.Direct[i] = i < addrs.size() ? addrs[i] : 0;
+    }
+
+    size_t entries = addrs.size() > POINTERS_PER_INODE ? addrs.size() - POINTERS_PER_INODE : 0;
+    size_t span = 1;
+    for(size_t level = 0; level < tree.size(); level++){
+        span *= FS_Geometry.PointersPerBlock;
+    }
+    if(span < entries){
+        return false;
+    }
+    inode.Indirect = tree.empty() ? 0 : tree[0][0];
+    inode.Levels = tree.size();
+
+    // Block k of a level covers entries [k*span, (k+1)*span)
+    size_t from = dirty_from > POINTERS_PER_INODE ? dirty_from - POINTERS_PER_INODE : 0;
+    size_t to = dirty_to > POINTERS_PER_INODE ? dirty_to - POINTERS_PER_INODE : 0;
+    Borrowed<Block> pointerBlock;
+    span = 1;
+    for(size_t level = tree.size(); level-- > 0 && from < to;){
+        span *= FS_Geometry.PointersPerBlock;
+        for(size_t k = from / span; k < tree[level].size() && k * span < to; k++){
+            for(size_t i = 0; i < FS_Geometry.PointersPerBlock; i++){
+                size_t child = k * FS_Geometry.PointersPerBlock + i;
+                uint64_t pointer = 0;
+                if(level + 1 < tree.size()){
+                    pointer = child < tree[level + 1].size() ? tree[level + 1][child] : 0;
+                } else {
+                    pointer = child < entries ? addrs[POINTERS_PER_INODE + child] : 0;
+                }
+                set_pointer(FS_Geometry, *pointerBlock, i, pointer);
+            }
+            write_block(tree[level][k], pointerBlock->Data);
+        }
+    }
+    return true;
+}
+
+size_t FileSystem::max_file_blocks() const {
+    size_t blocks = 1;
+    for(size_t level = 0; level < max_indirect_levels(FS_Geometry); level++){
+        blocks *= FS_Geometry.PointersPerBlock;
+    }
+    return POINTERS_PER_INODE + blocks;
+}
+
+// Every block below FS_Free_Hint is in use, so the search starts there; the
+// hint only moves back when a block is freed.
 size_t FileSystem::find_free(){
-    for(int i= 0 ; i < int(FS_Blocks) ; i++){
-        if(FS_Bitmap[i] == 0){
-            return (size_t) i;
+    size_t i = next_refcount(FS_Free_Hint, true);
+    FS_Free_Hint = i;
+    return i < FS_Geometry.Blocks ? i : -1;
+}
+
+size_t FileSystem::find_free_run(size_t nblocks){
+    size_t i = FS_Free_Hint;
+    while(i < FS_Geometry.Blocks){
+        size_t start = next_refcount(i, true);
+        i = next_refcount(start, false);
+        if(i - start >= nblocks){
+            return start;
         }
     }
 
     return -1;
 }
 
+// Find the first block at or after from that is free (or in use), a vector
+// of reference counts at a time; returns the number of blocks if none is
+size_t FileSystem::next_refcount(size_t from, bool free){
+    while(from < FS_Geometry.Blocks){
+        const uint32_t *counts;
+        size_t count;
+        if(FS_Bitmap != NULL){
+            counts = FS_Bitmap + from;
+            count = FS_Geometry.Blocks - from;
+        } else {
+            counts = refcount_entry(from, false);
+            count = std::min(REFCOUNTS_PER_BLOCK - from % REFCOUNTS_PER_BLOCK, FS_Geometry.Blocks - from);
+        }
+
+        size_t found = free ? scan_first_zero32(counts, count) : scan_first_nonzero32(counts, count);
+        from += found;
+        if(found < count){
+            break;
+        }
+    }
+    return std::min(from, FS_Geometry.Blocks);
+}
+
+size_t FileSystem::free_blocks(){
+    if(FS_Disk == NULL){
+        return 0;
+    }
+
+    size_t used = 0;
+    for(size_t from = data_start(); from < FS_Geometry.Blocks; ){
+        size_t count;
+        if(FS_Bitmap != NULL){
+            count = FS_Geometry.Blocks - from;
+            used += count_nonzero32(FS_Bitmap + from, count);
+        } else {
+            count = std::min(REFCOUNTS_PER_BLOCK - from % REFCOUNTS_PER_BLOCK, FS_Geometry.Blocks - from);
+            used += count_nonzero32(refcount_entry(from, false), count);
+        }
+        from += count;
+    }
+
+    return FS_Geometry.Blocks - data_start() - used;
+}
+
+// Drop one reference to a block, queueing it for discard once it is free
+void FileSystem::release_block(size_t blocknum){
+    uint32_t count = refcount(blocknum);
+    if(count == 0){
+        return;
+    }
+
+    set_refcount(blocknum, --count);
+    if(count == 0 && Discard_Immediate){
+        Pending_Discards.push_back(blocknum);
+    }
+}
+
+// Punch holes for queued blocks, merging adjacent ones into single discards
+void FileSystem::flush_discards(){
+    std::vector<size_t> pending;
+    pending.swap(Pending_Discards);
+    std::sort(pending.begin(), pending.end());
+
+    size_t start = 0, count = 0;
+    for(size_t i = 0; i <= pending.size(); i++){
+        // Skip anything reallocated since it was queued
+        if(i < pending.size() && refcount(pending[i]) != 0){
+            continue;
+        }
+        if(i < pending.size() && count > 0 && pending[i] < start + count){
+            continue;
+        }
+        if(i < pending.size() && count > 0 && pending[i] == start + count){
+            count++;
+            continue;
+        }
+        if(count > 0){
+            FS_Disk->discard(start, count);
+        }
+        if(i < pending.size()){
+            start = pending[i];
+            count = 1;
+        }
+    }
+}
+
 void FileSystem::print_block_list(){
-    for(int i = 0 ; i < FS_Blocks; i++){
-        printf("[%d] %u \n "  , i, FS_Bitmap[i]);    
+    for(size_t i = 0 ; i < FS_Geometry.Blocks; i++){
+        printf("[%lu] %u \n "  , i, refcount(i));
     }
 }
 
 int FileSystem::load_inode_block(size_t inumber, bool already_loaded){
-    int tmp_index = inumber;
-    int tmp_inode_block = 1;
-
-    if(tmp_index >= (int) INODES_PER_BLOCK){
-        tmp_index = tmp_index - INODES_PER_BLOCK;
-        tmp_inode_block++;
+    if(inumber >= FS_Geometry.Inodes){
+        return -1;
     }
 
+    int tmp_index = inumber % FS_Geometry.InodesPerBlock;
+    size_t tmp_inode_block = 1 + inumber / FS_Geometry.InodesPerBlock;
+
     //if(tmp_inode_block != current_inode_block){
         //current_inode_block = tmp_inode_block;
-        // TODO, return false if the index is smaller than 0, or larger than the number of inodes 
-        if(already_loaded == false){
-            FS_Disk->read(tmp_inode_block, FS_Inode_Block.Data);
+        if(already_loaded == false && !read_block(tmp_inode_block, FS_Inode_Block->Data)){
+            return -1;
         }
     //}
-    if(tmp_index >= 0 && tmp_index < INODES_PER_BLOCK){
-        return tmp_index;
-    }else{
-        return -1;
-    }
+    return tmp_index;
 }
 
 int FileSystem::save_inode_block(size_t inumber){
-    int tmp_index = inumber;
-    int tmp_inode_block = 1;
-
-    if(tmp_index >= (int) INODES_PER_BLOCK){
-        tmp_index = tmp_index - INODES_PER_BLOCK;
-        tmp_inode_block++;
+    if(inumber >= FS_Geometry.Inodes){
+        return -1;
     }
 
-    // TODO, return false if the index is smaller than 0, or larger than the number of inodes 
-    FS_Disk->write(tmp_inode_block, FS_Inode_Block.Data);
+    size_t tmp_inode_block = 1 + inumber / FS_Geometry.InodesPerBlock;
+    write_block(tmp_inode_block, FS_Inode_Block->Data);
 
     return 0;
 }
+
+bool FileSystem::load_inode(size_t inumber, InodeV2 &inode, bool already_loaded){
+    int tmp_index = load_inode_block(inumber, already_loaded);
+    if(tmp_index < 0){
+        return false;
+    }
+
+    decode_inode(FS_Geometry, *FS_Inode_Block, tmp_index, inode);
+    return true;
+}
+
+// Inodes sharing a block that fails its checksum are left alone, rather
+// than written back with a fresh checksum over the corrupt contents
+bool FileSystem::save_inode(size_t inumber, const InodeV2 &inode, bool already_loaded){
+    int tmp_index = load_inode_block(inumber, already_loaded);
+    if(tmp_index < 0){
+        return false;
+    }
+
+    encode_inode(FS_Geometry, *FS_Inode_Block, tmp_index, inode);
+    save_inode_block(inumber);
+    return true;
+}
+
 // Debug file system -----------------------------------------------------------
 
 void FileSystem::debug(Disk *disk) {
-    Block block;
+    Borrowed<Block> block;
+    Geometry geometry;
 
     // Read Superblock
-    disk->read(0, block.Data);
+    disk->read(0, block->Data);
 
     printf("SuperBlock:\n");
-    if (block.Super.MagicNumber == MAGIC_NUMBER) {
+    if (read_geometry(*block, geometry)) {
 	    printf("    magic number is valid\n");
-    } 
+    }
     else {
         printf("    magic number is invalid\n");
     }
-    printf("    %u blocks\n"         , block.Super.Blocks);
-    printf("    %u inode blocks\n"   , block.Super.InodeBlocks);
-    printf("    %u inodes\n"         , block.Super.Inodes);
-
+    if (geometry.Version == 2) {
+        printf("    version 2\n");
+    }
+    printf("    %lu blocks\n"         , geometry.Blocks);
+    printf("    %lu inode blocks\n"   , geometry.InodeBlocks);
+    printf("    %lu inodes\n"         , geometry.Inodes);
+    if (geometry.ChecksumBlocks) {
+        printf("    %lu checksum blocks\n", geometry.ChecksumBlocks);
+    }
+    if (geometry.RefcountBlocks) {
+        printf("    %lu refcount blocks\n", geometry.RefcountBlocks);
+    }
+    if (geometry.Version == 2 || block->Super.MagicNumber == MAGIC_NUMBER_EXT) {
+        printf("    %lu bytes per block\n", geometry.BlockSize);
+    }
 
+    // Inode blocks laid out for another block size would be misread, as
+    // mount refuses them too
+    if (geometry.BlockSize != Disk::BLOCK_SIZE) {
+        printf("    formatted with %lu byte blocks, this build reads %lu\n", geometry.BlockSize, (size_t)Disk::BLOCK_SIZE);
+        return;
+    }
 
     // Read Inode blocks
-    Block inode_block, pointer_block;
+    Borrowed<Block> inode_block, pointer_block;
+    InodeV2 inode;
     bool need_indirect = true;
+    std::vector<uint32_t> valid(geometry.InodesPerBlock);
     // For Each Inode Block
-    for (uint32_t k = 1; k <= block.Super.InodeBlocks; k++) {
-        disk->read(k, inode_block.Data);
-
-        // For each Inode 
-        for (uint32_t i = 0; i < INODES_PER_BLOCK; i++) {
-            if (inode_block.Inodes[i].Valid){
-
-                printf("Inode %d:\n", i*k);
-                printf("    size: %u bytes\n" , inode_block.Inodes[i].Size);
+    for (size_t k = 1; k <= geometry.InodeBlocks; k++) {
+        disk->read(k, inode_block->Data);
+
+        // For each valid Inode
+        size_t nvalid = scan_valid((const uint32_t *)inode_block->Data, geometry.InodesPerBlock,
+                                   (geometry.Version == 2 ? INODE_SIZE_V2 : INODE_SIZE) / sizeof(uint32_t), valid.data());
+        for (size_t v = 0; v < nvalid; v++) {
+            size_t i = valid[v];
+            decode_inode(geometry, *inode_block, i, inode);
+            if (inode.Valid){
+
+                printf("Inode %lu:\n", (k - 1)*geometry.InodesPerBlock + i);
+                printf("    size: %lu bytes\n" , inode.Size);
+                if (inode.Valid & INODE_PREALLOCATED) {
+                    printf("    preallocated\n");
+                }
 
                 // For each of the pointers in the inode
                 printf("    direct blocks:");
                 for (uint32_t j = 0; j < POINTERS_PER_INODE; j++) {
-                    if (inode_block.Inodes[i].Direct[j]) {
+                    if (inode.Direct[j]) {
                         //if(j != 0) printf(" ");
-                        printf(" %u",inode_block.Inodes[i].Direct[j]);
+                        printf(" %lu", inode.Direct[j]);
                     }
                     else{
                         need_indirect = false;
@@ -150,51 +649,103 @@ void FileSystem::debug(Disk *disk) {
                 printf("\n");
 
 		// indirect blocks
-                if(need_indirect){
-                    size_t indirect_addr = inode_block.Inodes[i].Indirect;
-                    printf("    indirect block: %u\n", indirect_addr);
-                    disk->read(indirect_addr, pointer_block.Data);
-
+                if(need_indirect && inode.Indirect != 0){
+                    size_t indirect_addr = inode.Indirect;
+                    printf("    indirect block: %lu\n", indirect_addr);
+
+                    // Each level of pointer blocks holds the next, down to
+                    // the level holding data block pointers
+                    std::vector<size_t> pointer_blocks(1, indirect_addr), next_blocks;
+                    size_t levels = std::min(indirect_levels(inode), max_indirect_levels(geometry));
+                    for(size_t level = 0; level < levels; level++){
+                        if(level + 1 < levels){
+                            printf("    level %lu pointer blocks:", level + 1);
+                        } else {
 		            printf("    indirect data blocks:");
-                    for(int j = 0; j < POINTERS_PER_BLOCK; j++){
-                        if(pointer_block.Pointers[j] != 0){
-                            //if(j != 0) printf(" ");
-                            printf(" %u",pointer_block.Pointers[j]);
                         }
-                        else{
-                            break;
+                        next_blocks.clear();
+                        for(size_t b = 0; b < pointer_blocks.size() && pointer_blocks[b] < geometry.Blocks; b++){
+                            disk->read(pointer_blocks[b], pointer_block->Data);
+                            size_t npointers = geometry.Version == 2 ? scan_first_zero64(pointer_block->PointersV2, geometry.PointersPerBlock)
+                                                                     : scan_first_zero32(pointer_block->Pointers, geometry.PointersPerBlock);
+                            for(size_t j = 0; j < npointers; j++){
+                                next_blocks.push_back(get_pointer(geometry, *pointer_block, j));
+                                printf(" %lu", next_blocks.back());
+                            }
                         }
+                        printf("\n");
+                        pointer_blocks.swap(next_blocks);
                     }
-                    printf("\n");
                 }
 		// reset flag
 		need_indirect = true;
             }
         }
-    }   
+    }
 }
 
 // Format file system ----------------------------------------------------------
 
-bool FileSystem::format(Disk *disk) {
+bool FileSystem::format(Disk *disk, uint32_t version, size_t bytes_per_inode) {
+    Trace::Span span("format");
     // check if already mounted, you can't format so return false
     if (disk->mounted()) return false;
+    if (version != 1 && version != 2) return false;
 
     //Block old_super;
     //disk->unmount();
     //disk->read(0,old_super.Data);
 
     size_t fs_size = disk->size();
+    size_t inodes_per_block = version == 2 ? INODES_PER_BLOCK_V2 : INODES_PER_BLOCK;
     size_t tmp_inode_data_pointer = fs_size / 10;
 
-    if(tmp_inode_data_pointer == 0) tmp_inode_data_pointer++;
+    // Version 1 block pointers are 32 bits
+    if(version == 1 && fs_size > UINT32_MAX) return false;
 
+    // One inode per bytes_per_inode bytes of disk
+    if(version == 2 && bytes_per_inode == 0) bytes_per_inode = BYTES_PER_INODE_V2;
+    if(bytes_per_inode > 0){
+        size_t tmp_inodes = fs_size / bytes_per_inode * Disk::BLOCK_SIZE + fs_size % bytes_per_inode * Disk::BLOCK_SIZE / bytes_per_inode;
+        tmp_inode_data_pointer = (tmp_inodes + inodes_per_block - 1) / inodes_per_block;
+    }
 
-    Block block;
-    block.Super.MagicNumber = MAGIC_NUMBER;
-    block.Super.Blocks = fs_size;
-    block.Super.InodeBlocks = tmp_inode_data_pointer;
-    block.Super.Inodes = block.Super.InodeBlocks * INODES_PER_BLOCK;
+    if(tmp_inode_data_pointer == 0) tmp_inode_data_pointer++;
+    if(version == 1 && tmp_inode_data_pointer * INODES_PER_BLOCK > UINT32_MAX) return false;
+
+    // One CRC32C per block, unless the disk is too small to spare the room
+    size_t tmp_checksum_blocks = (fs_size + CHECKSUMS_PER_BLOCK - 1) / CHECKSUMS_PER_BLOCK;
+    if(version == 1 && 1 + tmp_inode_data_pointer + tmp_checksum_blocks >= fs_size) tmp_checksum_blocks = 0;
+
+    // Version 2 also keeps the reference count of every block on disk
+    size_t tmp_refcount_blocks = version == 2 ? (fs_size + REFCOUNTS_PER_BLOCK - 1) / REFCOUNTS_PER_BLOCK : 0;
+
+    size_t tmp_data_start = 1 + tmp_inode_data_pointer + tmp_checksum_blocks + tmp_refcount_blocks;
+    if(tmp_data_start > fs_size) return false;
+
+
+    Borrowed<Block> block;
+    memset(block->Data, 0, Disk::BLOCK_SIZE);
+    if(version == 2){
+        block->SuperV2.MagicNumber = MAGIC_NUMBER_V2;
+        block->SuperV2.BlockSize = Disk::BLOCK_SIZE;
+        block->SuperV2.Blocks = fs_size;
+        block->SuperV2.InodeBlocks = tmp_inode_data_pointer;
+        block->SuperV2.Inodes = tmp_inode_data_pointer * INODES_PER_BLOCK_V2;
+        block->SuperV2.ChecksumBlocks = tmp_checksum_blocks;
+        block->SuperV2.RefcountBlocks = tmp_refcount_blocks;
+    } else {
+        // Images older tools can read keep the original magic number
+        bool extended = tmp_checksum_blocks != 0 || Disk::BLOCK_SIZE != Disk::LEGACY_BLOCK_SIZE;
+        block->Super.MagicNumber = extended ? MAGIC_NUMBER_EXT : MAGIC_NUMBER;
+        block->Super.Blocks = fs_size;
+        block->Super.InodeBlocks = tmp_inode_data_pointer;
+        block->Super.Inodes = block->Super.InodeBlocks * INODES_PER_BLOCK;
+        if(extended){
+            block->Super.ChecksumBlocks = tmp_checksum_blocks;
+            block->Super.BlockSize = Disk::BLOCK_SIZE;
+        }
+    }
     //Block new_super;
     //new_super.Super.MagicNumber = old_super.Super.MagicNumber;
     //new_super.Super.Blocks = fs_size;
@@ -202,18 +753,24 @@ bool FileSystem::format(Disk *disk) {
     //new_super.Super.Inodes = 0;
 
     // Write superblock
-    disk->write(0,block.Data);
+    disk->write(0,block->Data);
     //disk->write(0,new_super.Data);
 
-    // Clear all other blocks
-    Block tmp_inode_block;
+    // Clear all other blocks (a zeroed checksum region records no checksums).
+    // Version 2 never reads a free data block, so only its metadata needs
+    // clearing, and punching that out keeps a sparse image sparse.
+    Borrowed<Block> tmp_inode_block;
 
     for (size_t i = 0; i < Disk::BLOCK_SIZE; i++) {
-	tmp_inode_block.Data[i] = 0;
+	tmp_inode_block->Data[i] = 0;
+    }
+    size_t tmp_clear_end = version == 2 ? tmp_data_start : fs_size;
+    if (version == 2 && disk->discard(1, tmp_data_start - 1)) {
+	tmp_clear_end = 1;
+    }
+    for (size_t j = 1; j < tmp_clear_end; j++) {
+	disk->write(j, tmp_inode_block->Data);
     }
-    for (size_t j = 1; j < fs_size; j++) {
-	disk->write(j, tmp_inode_block.Data);
-    }	
     /*
     // For each of the blocks which hold inode information
     for(int i = 1; i <= int(tmp_inode_data_pointer); i++){
@@ -226,10 +783,10 @@ bool FileSystem::format(Disk *disk) {
             for(int i = 0; i < 5; i++){
                 tmp_inode.Direct[i] = 0;
             }
-            tmp_inode_block.Inodes[j] = tmp_inode;
+            tmp_inode_block->Inodes[j] = tmp_inode;
         }
-        // And write the new block to the correct position 
-        disk->write(i,tmp_inode_block.Data);
+        // And write the new block to the correct position
+        disk->write(i,tmp_inode_block->Data);
     }
     */
 
@@ -238,69 +795,129 @@ bool FileSystem::format(Disk *disk) {
 
 // Mount file system -----------------------------------------------------------
 
+// Undo a mount that found the image unusable part way through
+void FileSystem::abort_mount(){
+    delete [] FS_Bitmap;
+    FS_Bitmap = NULL;
+    FS_Refcount_Cache.clear();
+    FS_Disk->unmount();
+    FS_Disk = NULL;
+}
+
 bool FileSystem::mount(Disk *disk) {
+    Trace::Span span("mount");
     // look if filesystem is present
-    if (disk->mounted()) return false;   
- 
+    if (disk->mounted()) return false;
+
     // Read superblock
-    disk->read(0,FS_Data_Block.Data);
+    disk->read(0,FS_Data_Block->Data);
+    Geometry geometry;
 
     // BAD MOUNT 1 & 2, Incorrect Magic Number
-    if(FS_Data_Block.Super.MagicNumber != MAGIC_NUMBER) return false;
+    if(!read_geometry(*FS_Data_Block, geometry)) return false;
 
     // BAD MOUNT 3, No Blocks
-    if(FS_Data_Block.Super.Blocks == 0) return false;  
+    if(geometry.Blocks == 0) return false;
+
+    // BAD MOUNT 4, Too Many Inode Blocks
+    if(geometry.InodeBlocks*geometry.InodesPerBlock > geometry.Inodes) return false;
+
+    // BAD MOUNT 5, Not Enough Inodes For the Number of Inode Blocks
+    if(geometry.Inodes != geometry.InodeBlocks*geometry.InodesPerBlock) return false;
 
-    // BAD MOUNT 4, Too Many Inode Blocks 
-    if(FS_Data_Block.Super.InodeBlocks*INODES_PER_BLOCK > FS_Data_Block.Super.Inodes) return false;
+    // BAD MOUNT 6, Checksum Region Missing Blocks Or Overlapping Data
+    if(geometry.ChecksumBlocks != 0 && geometry.ChecksumBlocks < (geometry.Blocks + CHECKSUMS_PER_BLOCK - 1) / CHECKSUMS_PER_BLOCK) return false;
+    if(1 + geometry.InodeBlocks + geometry.ChecksumBlocks + geometry.RefcountBlocks > geometry.Blocks) return false;
+
+    // BAD MOUNT 7, Formatted With A Different Block Size Than This Build
+    if(geometry.BlockSize != Disk::BLOCK_SIZE) return false;
+
+    // BAD MOUNT 8, Version 2 Without A Checksum And Reference Count For Every Block
+    if(geometry.Version == 2 && (geometry.ChecksumBlocks == 0 || geometry.RefcountBlocks < (geometry.Blocks + REFCOUNTS_PER_BLOCK - 1) / REFCOUNTS_PER_BLOCK)) return false;
+
+    // BAD MOUNT 9, File System Larger Than The Disk
+    if(geometry.Blocks > disk->size()) return false;
 
-    // BAD MOUNT 5, Not Enough Inodes For the Number of Inode Blocks 
-    if(FS_Data_Block.Super.Inodes != FS_Data_Block.Super.InodeBlocks*INODES_PER_BLOCK) return false;
     // Set device and mount
 
     FS_Disk = disk;
     disk->mount();
 
     // Copy metadata
-    FS_Blocks = FS_Data_Block.Super.Blocks;             // Total Number of blocks
-    FS_InodeBlocks = FS_Data_Block.Super.InodeBlocks;   // Number of inode blocks
-    FS_Inodes = FS_Data_Block.Super.Inodes;             // Number of inodes 
-
-    // Allocate free block bitmap & Initialize Values
-    FS_Bitmap = new int[FS_Blocks];
-    for(uint32_t i = 0 ; i < FS_Blocks; i++){
-        if(i <= FS_InodeBlocks){
+    FS_Geometry = geometry;
+    current_checksum_block = 0;
+    checksum_dirty = false;
+    Checksum_Errors = 0;
+    FS_Open_Inodes.clear();
+    FS_Handles.clear();
+    Pending_Discards.clear();
+    FS_Free_Hint = data_start();
+    FS_Inode_Hint = 0;
+
+    delete [] FS_Bitmap;
+    FS_Bitmap = NULL;
+    FS_Refcount_Cache.clear();
+
+    // Version 2 reference counts live on disk: nothing to scan, and memory
+    // use is the same at any size.
+    if(geometry.Version == 2){
+        FS_Refcount_Cache.resize(REFCOUNT_CACHE_BLOCKS);
+        return true;
+    }
+
+    // Allocate free block bitmap & Initialize Values. Each entry counts the
+    // pointers to that block, so data blocks shared by clones count > 1.
+    FS_Bitmap = new uint32_t[FS_Geometry.Blocks];
+    for(size_t i = 0 ; i < FS_Geometry.Blocks; i++){
+        if(i < data_start()){
             FS_Bitmap[i] = 1;
         }else{
             FS_Bitmap[i] = 0;
         }
     }
 
-    // Update the Bitmap for every address pointed to in an inode 
-    int tmp_index = 1;
-    FS_Disk->read(tmp_index, FS_Inode_Block.Data);
-
-    for(uint32_t i = 0 , x=0; i < FS_Inodes; i++, x++){
-        if(x == INODES_PER_BLOCK){
-            tmp_index++;
-            x = 0;
-            FS_Disk->read(tmp_index, FS_Inode_Block.Data);
+    // Update the Bitmap for every address pointed to in an inode. The scans
+    // pick out valid inodes and non-zero pointers a vector at a time.
+    std::vector<uint32_t> valid(INODES_PER_BLOCK), pointers(POINTERS_PER_BLOCK);
+    for(size_t tmp_index = 1; tmp_index <= FS_Geometry.InodeBlocks; tmp_index++){
+        // BAD MOUNT 10, Inode Or Indirect Block Failing Its Checksum
+        if(!read_block(tmp_index, FS_Inode_Block->Data)){
+            abort_mount();
+            return false;
         }
-
-        if(FS_Inode_Block.Inodes[x].Valid){ 
-            for(uint32_t j = 0 ; j < 5 ; j++){
-                if(FS_Inode_Block.Inodes[x].Direct[j] != 0){
-                    FS_Bitmap[FS_Inode_Block.Inodes[x].Direct[j]] = 1;
-                }  
+        size_t nvalid = scan_valid((const uint32_t *)FS_Inode_Block->Inodes, INODES_PER_BLOCK, INODE_SIZE / sizeof(uint32_t), valid.data());
+
+        // BAD MOUNT 11, Inode Or Indirect Block Pointing Outside The Data Blocks
+        for(size_t v = 0; v < nvalid; v++){
+            Inode inode = FS_Inode_Block->Inodes[valid[v]];
+            for(uint32_t j = 0 ; j < POINTERS_PER_INODE ; j++){
+                if(inode.Direct[j] != 0){
+                    if(!data_block(inode.Direct[j])){
+                        abort_mount();
+                        return false;
+                    }
+                    FS_Bitmap[inode.Direct[j]]++;
+                }
             }
-            if(FS_Inode_Block.Inodes[x].Indirect != 0){
-                FS_Disk->read(FS_Inode_Block.Inodes[x].Indirect, FS_Inode_Block.Data);
-                for(uint32_t j = 0 ; j < POINTERS_PER_BLOCK ; j++){
-                    if(FS_Inode_Block.Pointers[j] != 0){
-                        FS_Bitmap[FS_Inode_Block.Pointers[j]] = 1;
+            if(inode.Indirect != 0){
+                if(!data_block(inode.Indirect)){
+                    abort_mount();
+                    return false;
+                }
+                FS_Bitmap[inode.Indirect]++;
+                if(!read_block(inode.Indirect, FS_Inode_Block->Data)){
+                    abort_mount();
+                    return false;
+                }
+                size_t npointers = scan_nonzero32(FS_Inode_Block->Pointers, POINTERS_PER_BLOCK, pointers.data());
+                for(size_t j = 0 ; j < npointers ; j++){
+                    if(!data_block(FS_Inode_Block->Pointers[pointers[j]])){
+                        abort_mount();
+                        return false;
                     }
+                    FS_Bitmap[FS_Inode_Block->Pointers[pointers[j]]]++;
                 }
-                FS_Disk->read(tmp_index, FS_Inode_Block.Data);
+                read_block(tmp_index, FS_Inode_Block->Data);
             }
         }
     }
@@ -313,53 +930,132 @@ bool FileSystem::mount(Disk *disk) {
 // Create inode ----------------------------------------------------------------
 
 size_t FileSystem::create() {
-    // Locate free inode in inode table
-    int inode = 0;
-    int tmp_index;
-    load_inode_block(0, false);
-    for(int i = 0 ; i < FS_Inodes ; i++){
-        tmp_index = load_inode_block(i);
-        if(FS_Inode_Block.Inodes[tmp_index].Valid == 0){
-            tmp_index = load_inode_block(i, false);
-            // Reset All of It's Data, Make It Valid, and Save this info to the inode block
-            FS_Inode_Block.Inodes[i].Valid = 1;
-            FS_Inode_Block.Inodes[i].Indirect = 0;
-            FS_Inode_Block.Inodes[i].Size = 0;
-            for(int j = 0 ; j < POINTERS_PER_INODE ; j++){
-                FS_Inode_Block.Inodes[i].Direct[j] = 0;
-            }
+    std::vector<size_t> inumbers;
+    return create(1, inumbers) == 1 ? inumbers[0] : -1;
+}
 
-            save_inode_block(i);
-         
-            // Return the inode # of the found inode. 
-            return i; 
+size_t FileSystem::create(size_t count, std::vector<size_t> &inumbers) {
+    Trace::Span span("create", "count", count);
+
+    // Locate free inodes in inode table, starting past those known to be in
+    // use, and write each inode block back once however many were taken
+    InodeV2 inode;
+    size_t created = 0;
+    bool dirty = false, usable = true;
+    size_t i = FS_Inode_Hint;
+    for(; i < FS_Geometry.Inodes && created < count; i++){
+        // Only read each inode block once, when we reach its first inode,
+        // and pass over blocks that fail their checksum
+        bool first = i == FS_Inode_Hint || i % FS_Geometry.InodesPerBlock == 0;
+        if(first && dirty){
+            save_inode_block(i - 1);
+            dirty = false;
+        }
+        if(first){
+            usable = load_inode(i, inode, false);
+        } else {
+            load_inode(i, inode, true);
+        }
+        if(usable && inode.Valid == 0){
+            // Reset All of It's Data and Make It Valid
+            memset(&inode, 0, sizeof(inode));
+            inode.Valid = INODE_VALID;
+            encode_inode(FS_Geometry, *FS_Inode_Block, i % FS_Geometry.InodesPerBlock, inode);
+            dirty = true;
+            inumbers.push_back(i);
+            created++;
         }
     }
-    //print_block_list();   
-    // Record inode if found
-    return -1;
+    if(dirty){
+        save_inode_block(i - 1);
+    }
+    flush_metadata();
+
+    // Record how far the table is known to be in use
+    FS_Inode_Hint = created < count ? FS_Geometry.Inodes : i;
+
+    for(size_t j = inumbers.size() - created; j < inumbers.size(); j++){
+        sync_inode(inumbers[j], true);
+    }
+    return created;
+}
+
+// Clone inode -----------------------------------------------------------------
+
+size_t FileSystem::clone(size_t inumber) {
+    Trace::Span span("clone", "inode", inumber);
+    std::vector<size_t> data_addrs;
+    InodeV2 source;
+
+    if(FS_Geometry.Version < 2){
+        return -1;
+    }
+
+    evict_inode(inumber);
+    if(!load_inode(inumber, source) || source.Valid == 0){
+        return -1;
+    }
+    get_data_addrs(source, data_addrs);
+
+    // The clone gets its own pointer blocks, holding the same pointers
+    PointerTree tree;
+    size_t clone_inumber = -1;
+    if(!grow_tree(tree, data_addrs.size() > POINTERS_PER_INODE ? data_addrs.size() - POINTERS_PER_INODE : 0) ||
+       (clone_inumber = create()) == (size_t)-1){
+        release_tree(tree);
+        flush_metadata();
+        return -1;
+    }
+
+    InodeV2 inode = source;
+    set_data_addrs(inode, data_addrs, tree, 0);
+
+    // Share every data block: writes to either file copy the block first
+    for(size_t j = 0; j < data_addrs.size(); j++){
+        set_refcount(data_addrs[j], refcount(data_addrs[j]) + 1);
+    }
+
+    save_inode(clone_inumber, inode);
+    flush_metadata();
+
+    return clone_inumber;
 }
 
 // Remove inode ----------------------------------------------------------------
 
 bool FileSystem::remove(size_t inumber) {
+    Trace::Span span("remove", "inode", inumber);
+    sync_inode(inumber, false);
+
     // Load inode information
-    int tmp_index = load_inode_block(inumber, false);  
-    if(FS_Inode_Block.Inodes[tmp_index].Valid == 0){
+    InodeV2 inode;
+    if(!load_inode(inumber, inode) || inode.Valid == 0){
        return false;
     }
 
-    // Set the Inode Valid Bit to 0 & save the information 
-    FS_Inode_Block.Inodes[tmp_index].Valid = 0;
-    save_inode_block(inumber);
+    // Drop a reference to each data block of the inode
+    std::vector<size_t> data_addrs;
+    PointerTree tree;
+    get_data_addrs(inode, data_addrs, &tree);
+    for(size_t j = 0; j < data_addrs.size(); j++){
+        release_block(data_addrs[j]);
+    }
 
-    // Set the value of each data block for the inode to 0 in the bitmap
-    int data_addrs[1029];
-    get_data_addrs(inumber, &data_addrs[0]);
-    for(int j = 0; data_addrs[j] != 0 ; j++){
-        FS_Bitmap[data_addrs[j]] = 0;
+    // Set the Inode Valid Bit to 0 & save the information
+    release_tree(tree);
+    inode.Valid = 0;
+    save_inode(inumber, inode);
+    flush_metadata();
+    flush_discards();
+
+    if(inumber < FS_Inode_Hint){
+        FS_Inode_Hint = inumber;
     }
 
+    // Handles still open on the inode now see an invalid file, and nothing
+    // cached for append outlives it
+    sync_inode(inumber, true);
+    evict_inode(inumber);
 
     //print_block_list();
     return true;
@@ -369,146 +1065,735 @@ bool FileSystem::remove(size_t inumber) {
 
 size_t FileSystem::stat(size_t inumber) {
 
+    // Open inodes may have grown past what is on disk
+    std::map<size_t, OpenInode>::iterator it = FS_Open_Inodes.find(inumber);
+    if(it != FS_Open_Inodes.end()){
+        return it->second.Node.Valid ? it->second.Node.Size : -1;
+    }
+
     // Load inode information
     current_inode_block = 0;
-    int tmp_index = load_inode_block(inumber, false);
+    InodeV2 inode;
 
-    if(tmp_index != -1){
-        if(FS_Inode_Block.Inodes[tmp_index].Valid != 0){
-           return FS_Inode_Block.Inodes[tmp_index].Size;
+    if(load_inode(inumber, inode)){
+        if(inode.Valid != 0){
+           return inode.Size;
         }
     }
 
     return -1;
 }
 
+// Open file handles -----------------------------------------------------------
+
+FileSystem::OpenInode *FileSystem::open_inode(int handle){
+    if(handle < 0 || (size_t)handle >= FS_Handles.size() || !FS_Handles[handle].Open){
+        return NULL;
+    }
+    return &FS_Open_Inodes[FS_Handles[handle].Inumber];
+}
+
+// Build the block map of an open inode the first time it is needed
+bool FileSystem::load_map(OpenInode &file){
+    if(file.MapLoaded){
+        return true;
+    }
+
+    if(!get_data_addrs(file.Node, file.Map, &file.Tree)){
+        return false;
+    }
+
+    file.MapLoaded = true;
+    return true;
+}
+
+// Allocate a data block at the end of an open file, and any pointer blocks
+// needed to hold it once the direct pointers run out; returns the new block,
+// or -1
+size_t FileSystem::map_append(OpenInode &file){
+    if(file.Map.size() >= max_file_blocks()){
+        return -1;
+    }
+
+    // New pointer blocks are written out even if no data block follows
+    if(file.Map.size() >= POINTERS_PER_INODE){
+        file.DirtyFrom = std::min(file.DirtyFrom, file.Map.size());
+        file.Dirty = true;
+        if(!grow_tree(file.Tree, file.Map.size() + 1 - POINTERS_PER_INODE)){
+            return -1;
+        }
+    }
+
+    size_t open_block = find_free();
+    if(open_block == (size_t)-1){
+        return -1;
+    }
+    set_refcount(open_block, 1);
+    file.Map.push_back(open_block);
+    file.Dirty = true;
+    return open_block;
+}
+
+// Find the block to write data block index of an open file to: appending
+// it, or copying it first if it is shared with a clone; returns -1 if full
+size_t FileSystem::writable_block(OpenInode &file, size_t index){
+    if(index >= file.Map.size()){
+        return map_append(file);
+    }
+
+    size_t data_pointer = file.Map[index];
+    if(refcount(data_pointer) > 1){
+        size_t open_block = find_free();
+        if(open_block == (size_t)-1){
+            return -1;
+        }
+        set_refcount(open_block, 1);
+        set_refcount(data_pointer, refcount(data_pointer) - 1);
+        data_pointer = file.Map[index] = open_block;
+        file.Dirty = true;
+        if(index >= POINTERS_PER_INODE){
+            file.DirtyFrom = std::min(file.DirtyFrom, index);
+        }
+    }
+    return data_pointer;
+}
+
+// Write an open inode and its changed pointer blocks back
+void FileSystem::flush_inode(size_t inumber, OpenInode &file){
+    if(file.MapLoaded){
+        set_data_addrs(file.Node, file.Map, file.Tree, file.DirtyFrom);
+    }
+
+    if(file.Dirty){
+        save_inode(inumber, file.Node);
+    }
+
+    flush_metadata();
+    file.Dirty = false;
+    file.DirtyFrom = -1;
+}
+
+// Write back an open inode, and optionally re-read it, so code working on the
+// inode table directly and open handles agree on the file
+void FileSystem::sync_inode(size_t inumber, bool reload){
+    std::map<size_t, OpenInode>::iterator it = FS_Open_Inodes.find(inumber);
+    if(it == FS_Open_Inodes.end()){
+        return;
+    }
+
+    flush_inode(inumber, it->second);
+    if(reload){
+        if(!load_inode(inumber, it->second.Node)){
+            it->second.Node.Valid = 0;
+        }
+        it->second.Map.clear();
+        it->second.Tree.clear();
+        it->second.MapLoaded = false;
+        it->second.TailIndex = -1;
+    }
+}
+
+// Drop an inode's append pin and cached tail block, once something other
+// than append is about to change its blocks. Handles keep their open inode.
+void FileSystem::evict_inode(size_t inumber){
+    std::map<size_t, OpenInode>::iterator it = FS_Open_Inodes.find(inumber);
+    if(it == FS_Open_Inodes.end()){
+        return;
+    }
+
+    flush_inode(inumber, it->second);
+    if(it->second.Refs == 0){
+        FS_Open_Inodes.erase(it);
+        return;
+    }
+    it->second.Appending = false;
+    it->second.TailIndex = -1;
+    it->second.Tail.reset();
+}
+
+int FileSystem::open(size_t inumber) {
+    std::map<size_t, OpenInode>::iterator it = FS_Open_Inodes.find(inumber);
+
+    // Every handle on a file shares one pinned copy of its inode
+    if(it == FS_Open_Inodes.end()){
+        OpenInode file;
+        if(!load_inode(inumber, file.Node) || file.Node.Valid == 0){
+            return -1;
+        }
+
+        file.MapLoaded = false;
+        file.Dirty = false;
+        file.DirtyFrom = -1;
+        file.Refs = 0;
+        file.Appending = false;
+        file.LastAppend = 0;
+        file.TailIndex = -1;
+        it = FS_Open_Inodes.insert(std::make_pair(inumber, std::move(file))).first;
+    } else if(it->second.Node.Valid == 0){
+        return -1;
+    }
+    it->second.Refs++;
+
+    // Reuse the first closed handle
+    size_t handle = 0;
+    while(handle < FS_Handles.size() && FS_Handles[handle].Open){
+        handle++;
+    }
+    if(handle == FS_Handles.size()){
+        FS_Handles.push_back(Handle());
+    }
+    FS_Handles[handle].Inumber = inumber;
+    FS_Handles[handle].Offset = 0;
+    FS_Handles[handle].Open = true;
+    return handle;
+}
+
+bool FileSystem::close(int handle) {
+    OpenInode *file = open_inode(handle);
+    if(file == NULL){
+        return false;
+    }
+
+    size_t inumber = FS_Handles[handle].Inumber;
+    flush_inode(inumber, *file);
+    FS_Handles[handle].Open = false;
+    if(--file->Refs == 0 && !file->Appending){
+        FS_Open_Inodes.erase(inumber);
+    }
+    return true;
+}
+
+size_t FileSystem::seek(int handle, size_t offset) {
+    if(open_inode(handle) == NULL){
+        return -1;
+    }
+
+    FS_Handles[handle].Offset = offset;
+    return offset;
+}
+
 // Read from inode -------------------------------------------------------------
 
 size_t FileSystem::read(size_t inumber, char *data, size_t length, size_t offset) {
+    Trace::Span span("read", "inode", inumber);
     //printf("PREFORMING A READ of inode %lu, length %lu, starting at offset %lu\n", inumber, length, offset);
 
-    int this_length, tmp_index, block_offset, data_block_index, data_pointer;
-    size_t bytes_copied;
-    size_t real_length = length;
-    int data_addrs[1029];
-
-    get_data_addrs(inumber, &data_addrs[0]);
-    tmp_index = load_inode_block(inumber);
-    block_offset = offset % 4096;
-    data_block_index = offset / 4096;
-
-    if(FS_Inode_Block.Inodes[tmp_index].Valid != 0){
- 
-        if(offset + length > FS_Inode_Block.Inodes[tmp_index].Size){
-            real_length = FS_Inode_Block.Inodes[tmp_index].Size - offset;
-            if(real_length == 0){
-                return -1;
-            }
-        }
+    int handle = open(inumber);
+    if(handle < 0){
+        return -1;
+    }
 
-        bytes_copied = 0;
-        while(bytes_copied < real_length){
+    size_t bytes_copied = -1;
+    if(offset < open_inode(handle)->Node.Size){
+        seek(handle, offset);
+        bytes_copied = read(handle, data, length);
+    }
 
-            data_pointer = data_addrs[data_block_index];  
-            // If the direct pointer points to a data block
-            if(data_pointer != 0){
+    close(handle);
+    return bytes_copied;
+}
 
-                if(block_offset + real_length - bytes_copied <= 4096){
-                    this_length = real_length - bytes_copied;
-                } 
-                else {
-                    // If for the starting block, the length goes past the bounds of the block...
-                    this_length = 4096 - block_offset;
-                    block_offset = 0;
-                }
+size_t FileSystem::read(int handle, char *data, size_t length) {
+    Trace::Span span("read", "bytes", length);
+    OpenInode *file = open_inode(handle);
+    if(file == NULL || file->Node.Valid == 0 || !load_map(*file)){
+        return -1;
+    }
 
-                FS_Disk->read(data_pointer, FS_Data_Block.Data);
-                strncpy(data, &FS_Data_Block.Data[block_offset], this_length);           
-                bytes_copied = bytes_copied + this_length;
+    size_t offset = FS_Handles[handle].Offset;
+    if(offset >= file->Node.Size){
+        return 0;
+    }
+    size_t real_length = std::min(length, (size_t)file->Node.Size - offset);
+    size_t data_block_index = offset / Disk::BLOCK_SIZE;
+    size_t block_offset = offset % Disk::BLOCK_SIZE;
+
+    size_t bytes_copied = 0;
+    bool   failed = false;
+    while(bytes_copied < real_length && data_block_index < file->Map.size()){
+        // Only the first block starts part way through
+        size_t this_length = std::min(real_length - bytes_copied, Disk::BLOCK_SIZE - block_offset);
+
+        // Whole blocks that are contiguous on disk are read straight into data
+        if(this_length == Disk::BLOCK_SIZE){
+            size_t run = 1;
+            while(bytes_copied + (run + 1)*Disk::BLOCK_SIZE <= real_length && data_block_index + run < file->Map.size() &&
+                  file->Map[data_block_index + run] == file->Map[data_block_index] + run){
+                run++;
             }
-            else{
+            size_t valid = read_blocks(file->Map[data_block_index], run, data + bytes_copied);
+            bytes_copied = bytes_copied + valid*Disk::BLOCK_SIZE;
+            data_block_index += valid;
+            if(valid < run){
+                failed = true;
                 break;
             }
-            //Go to next data block
-            data_block_index++;
+            continue;
         }
-        return bytes_copied;
 
+        if(!read_block(file->Map[data_block_index], FS_Data_Block->Data)){
+            failed = true;
+            break;
+        }
+        memcpy(data + bytes_copied, &FS_Data_Block->Data[block_offset], this_length);
+        bytes_copied = bytes_copied + this_length;
+        block_offset = 0;
+
+        //Go to next data block
+        data_block_index++;
     }
 
-    // Read block and copy to data
-    return -1;
+    // A bad block ends the read early; it fails only if nothing came before
+    if(failed && bytes_copied == 0){
+        return -1;
+    }
+    FS_Handles[handle].Offset += bytes_copied;
+    return bytes_copied;
 }
 
 // Write to inode --------------------------------------------------------------
 
 size_t FileSystem::write(size_t inumber, char *data, size_t length, size_t offset) {
+    Trace::Span span("write", "inode", inumber);
 
     //printf("PREFORMING A WRITE of inode %lu, length %lu, starting at offset %lu\n", inumber, length, offset);
 
-    int this_length, tmp_index, block_offset, data_block_index, data_pointer;
-    size_t bytes_copied;
-    int data_addrs[1029];
+    int handle = open(inumber);
+    if(handle < 0){
+        return -1;
+    }
+
+    seek(handle, offset);
+    size_t bytes_copied = write(handle, data, length);
 
-    get_data_addrs(inumber, &data_addrs[0]);
-    tmp_index = load_inode_block(inumber);
-    data_block_index = offset / 4096;
-    block_offset = offset % 4096;
+    close(handle);
+    return bytes_copied;
+}
 
-    // IF THE INODE IS VALID
-    if(FS_Inode_Block.Inodes[tmp_index].Valid != 0){
+size_t FileSystem::write(int handle, char *data, size_t length) {
+    Trace::Span span("write", "bytes", length);
+    OpenInode *file = open_inode(handle);
+    if(file == NULL || file->Node.Valid == 0 || !load_map(*file)){
+        return -1;
+    }
 
+    size_t offset = FS_Handles[handle].Offset;
+    size_t data_block_index = offset / Disk::BLOCK_SIZE;
+    size_t block_offset = offset % Disk::BLOCK_SIZE;
 
-        bytes_copied = 0;
-        while(bytes_copied < length){
- 
-            data_pointer = data_addrs[data_block_index];
-            if(data_pointer != 0){
+    // Blocks past the end of the file (preallocated ones) hold no data yet
+    size_t used_blocks = (file->Node.Size + Disk::BLOCK_SIZE - 1) / Disk::BLOCK_SIZE;
+    file->TailIndex = -1;
 
-                if(block_offset + length - bytes_copied <= 4096){
-                    this_length = length - bytes_copied;
-                } 
-                else {
-                    this_length = 4096 - block_offset;
-                    block_offset = 0;
-                }
+    // Files have no holes: zero fill any gap between the last block and the cursor
+    for(size_t index = used_blocks; index < data_block_index; index++){
+        size_t open_block = writable_block(*file, index);
+        if(open_block == (size_t)-1){
+            file->Node.Size = std::max((size_t)file->Node.Size, index * Disk::BLOCK_SIZE);
+            file->Dirty = true;
+            return 0;
+        }
+        memset(FS_Data_Block->Data, 0, Disk::BLOCK_SIZE);
+        write_block(open_block, FS_Data_Block->Data);
+    }
+
+    // Whole blocks are written straight from data, gathered into runs of
+    // blocks that are contiguous on disk
+    size_t run_start = 0, run_length = 0, run_offset = 0;
+
+    size_t bytes_copied = 0;
+    while(bytes_copied < length){
+        size_t this_length = std::min(length - bytes_copied, Disk::BLOCK_SIZE - block_offset);
+
+        if(this_length == Disk::BLOCK_SIZE){
+            // A new block, or a private copy of one shared with a clone
+            size_t data_pointer = writable_block(*file, data_block_index);
+            if(data_pointer == (size_t)-1){
+                break;
+            }
+            if(run_length > 0 && data_pointer != run_start + run_length){
+                write_blocks(run_start, run_length, data + run_offset);
+                run_length = 0;
+            }
+            if(run_length == 0){
+                run_start = data_pointer;
+                run_offset = bytes_copied;
+            }
+            run_length++;
+
+            bytes_copied = bytes_copied + this_length;
+            data_block_index++;
+            continue;
+        }
+
+        // Only read the old contents back if part of the block survives
+        size_t data_pointer = data_block_index < std::min(used_blocks, file->Map.size()) ? file->Map[data_block_index] : 0;
+        if(data_pointer != 0){
+            if(!read_block(data_pointer, FS_Data_Block->Data)){
+                break;
+            }
+        } else{
+            memset(FS_Data_Block->Data, 0, Disk::BLOCK_SIZE);
+        }
 
-                FS_Disk->read(data_pointer, FS_Data_Block.Data);
-                strncpy(&FS_Data_Block.Data[block_offset], data, this_length);           
-                FS_Disk->write(data_pointer, FS_Data_Block.Data);
-
-                bytes_copied = bytes_copied + this_length;
-                data_block_index++;
-            } else{
-                // IF THERE IS NOT A DATA BLOCK POINTED TO CREATE ONE, UPDATE SIZE, DO NOT INCREMENT LOOP
-                size_t open_block = find_free();
-                if(open_block == -1){
-                    return bytes_copied;
+        data_pointer = writable_block(*file, data_block_index);
+        if(data_pointer == (size_t)-1){
+            break;
+        }
+
+        memcpy(&FS_Data_Block->Data[block_offset], data + bytes_copied, this_length);
+        write_block(data_pointer, FS_Data_Block->Data);
+
+        bytes_copied = bytes_copied + this_length;
+        block_offset = 0;
+        data_block_index++;
+    }
+    if(run_length > 0){
+        write_blocks(run_start, run_length, data + run_offset);
+    }
+
+    // Grow the file to cover what was written; the inode reaches the disk on close
+    if(offset + bytes_copied > file->Node.Size){
+        file->Node.Size = offset + bytes_copied;
+        file->Dirty = true;
+    }
+
+    FS_Handles[handle].Offset += bytes_copied;
+    return bytes_copied;
+}
+
+// Append to inode -------------------------------------------------------------
+
+// Pin an inode for append without a handle, dropping the least recently
+// appended to once more than APPEND_STREAMS are pinned; returns NULL if the
+// inode is not valid
+FileSystem::OpenInode *FileSystem::pin_inode(size_t inumber){
+    std::map<size_t, OpenInode>::iterator it = FS_Open_Inodes.find(inumber);
+    if(it == FS_Open_Inodes.end()){
+        OpenInode file;
+        if(!load_inode(inumber, file.Node) || file.Node.Valid == 0){
+            return NULL;
+        }
+
+        file.MapLoaded = false;
+        file.Dirty = false;
+        file.DirtyFrom = -1;
+        file.Refs = 0;
+        file.Appending = false;
+        file.LastAppend = 0;
+        file.TailIndex = -1;
+        it = FS_Open_Inodes.insert(std::make_pair(inumber, std::move(file))).first;
+    } else if(it->second.Node.Valid == 0){
+        return NULL;
+    }
+
+    if(!it->second.Appending){
+        size_t pinned = 0;
+        std::map<size_t, OpenInode>::iterator oldest = FS_Open_Inodes.end();
+        for(std::map<size_t, OpenInode>::iterator o = FS_Open_Inodes.begin(); o != FS_Open_Inodes.end(); o++){
+            if(o->second.Appending && o->second.Refs == 0){
+                pinned++;
+                if(oldest == FS_Open_Inodes.end() || o->second.LastAppend < oldest->second.LastAppend){
+                    oldest = o;
                 }
+            }
+        }
+        if(pinned >= APPEND_STREAMS){
+            flush_inode(oldest->first, oldest->second);
+            FS_Open_Inodes.erase(oldest);
+        }
+        it->second.Appending = true;
+    }
+
+    it->second.LastAppend = ++Append_Clock;
+    return &it->second;
+}
+
+size_t FileSystem::append(size_t inumber, char *data, size_t length) {
+    Trace::Span span("append", "inode", inumber);
+    OpenInode *file = pin_inode(inumber);
+    if(file == NULL || !load_map(*file)){
+        return -1;
+    }
+    if(!file->Tail){
+        file->Tail.reset(new Borrowed<Block>());
+    }
+    Block &tail = **file->Tail;
+
+    size_t offset = file->Node.Size;
+    size_t data_block_index = offset / Disk::BLOCK_SIZE;
+    size_t block_offset = offset % Disk::BLOCK_SIZE;
+
+    size_t bytes_copied = 0;
+    while(bytes_copied < length){
+        size_t this_length = std::min(length - bytes_copied, Disk::BLOCK_SIZE - block_offset);
 
-                // Update the Address array, Bitmap
-                data_addrs[data_block_index] = open_block;
-                FS_Bitmap[open_block] = 1;
-
-                //Update the Inode Info
-                // BROKEN, NEED TO BE ABLE TO ADD TO INFO TO INDIRECT BLOCK 
-                FS_Inode_Block.Inodes[tmp_index].Direct[data_block_index] = open_block;
-                if(block_offset + length <= 4096){
-                    FS_Inode_Block.Inodes[tmp_index].Size = FS_Inode_Block.Inodes[tmp_index].Size + block_offset + length - bytes_copied;
-                } 
-                else {
-                    FS_Inode_Block.Inodes[tmp_index].Size = FS_Inode_Block.Inodes[tmp_index].Size + 4096 - block_offset;
+        // The partial last block is read at most once, then kept; a fresh
+        // block (new or preallocated) starts out as zeros
+        if(block_offset != 0 && file->TailIndex != data_block_index){
+            if(!read_block(file->Map[data_block_index], tail.Data)){
+                break;
+            }
+        } else if(block_offset == 0){
+            memset(tail.Data, 0, Disk::BLOCK_SIZE);
+        }
+        file->TailIndex = -1;
+
+        size_t data_pointer = writable_block(*file, data_block_index);
+        if(data_pointer == (size_t)-1){
+            break;
+        }
+
+        if(this_length == Disk::BLOCK_SIZE){
+            write_block(data_pointer, data + bytes_copied);
+        } else {
+            memcpy(&tail.Data[block_offset], data + bytes_copied, this_length);
+            write_block(data_pointer, tail.Data);
+            file->TailIndex = data_block_index;
+        }
+
+        bytes_copied = bytes_copied + this_length;
+        block_offset = 0;
+        data_block_index++;
+    }
+
+    // Only the size changes in memory; the inode reaches the disk on sync
+    if(bytes_copied > 0){
+        file->Node.Size = offset + bytes_copied;
+        file->Dirty = true;
+    }
+    return bytes_copied;
+}
+
+size_t FileSystem::preallocate(size_t inumber, size_t length) {
+    OpenInode *file = pin_inode(inumber);
+    if(file == NULL || !load_map(*file)){
+        return -1;
+    }
+
+    size_t needed = (file->Node.Size + length + Disk::BLOCK_SIZE - 1) / Disk::BLOCK_SIZE;
+    if(needed > max_file_blocks()){
+        return -1;
+    }
+    if(needed <= file->Map.size()){
+        return 0;
+    }
+    size_t nblocks = needed - file->Map.size();
+
+    // Extend the file's last run in place if the blocks after it are free,
+    // else take the first free run long enough; failing both, blocks are
+    // allocated one at a time
+    size_t start = -1;
+    if(!file->Map.empty()){
+        size_t next = file->Map.back() + 1;
+        if(next < FS_Geometry.Blocks && next_refcount(next, false) - next >= nblocks){
+            start = next;
+        }
+    }
+    if(start == (size_t)-1){
+        start = find_free_run(nblocks);
+    }
+
+    size_t reserved = 0;
+    if(start != (size_t)-1){
+        for(; reserved < nblocks; reserved++){
+            set_refcount(start + reserved, 1);
+            file->Map.push_back(start + reserved);
+        }
+        file->Dirty = true;
+
+        // Taken once the run is, so they cannot land inside it
+        if(file->Map.size() > POINTERS_PER_INODE){
+            file->DirtyFrom = std::min(file->DirtyFrom, file->Map.size() - reserved);
+            if(!grow_tree(file->Tree, file->Map.size() - POINTERS_PER_INODE)){
+                for(; reserved > 0; reserved--){
+                    set_refcount(file->Map.back(), 0);
+                    file->Map.pop_back();
                 }
-                save_inode_block(inumber); 
+                return -1;
             }
-                      
         }
+    } else {
+        for(; reserved < nblocks; reserved++){
+            if(map_append(*file) == (size_t)-1){
+                break;
+            }
+        }
+    }
+
+    if(reserved > 0){
+        file->Node.Valid |= INODE_PREALLOCATED;
+        file->Dirty = true;
+    }
+    flush_inode(inumber, *file);
+    return reserved;
+}
+
+bool FileSystem::sync(size_t inumber) {
+    std::map<size_t, OpenInode>::iterator it = FS_Open_Inodes.find(inumber);
+    if(it == FS_Open_Inodes.end()){
+        return stat(inumber) != (size_t)-1;
+    }
+    if(it->second.Node.Valid == 0){
+        return false;
+    }
+
+    flush_inode(inumber, it->second);
+    return true;
+}
+
+// Defragment inode ------------------------------------------------------------
+
+size_t FileSystem::fragmentation(size_t inumber) {
+    std::vector<size_t> data_addrs;
+    InodeV2 inode;
+
+    sync_inode(inumber, false);
+
+    if(!load_inode(inumber, inode) || inode.Valid == 0){
+        return -1;
+    }
+    get_data_addrs(inode, data_addrs);
+
+    // Count runs of contiguous blocks
+    size_t extents = 0;
+    for(size_t i = 0; i < data_addrs.size(); i++){
+        if(i == 0 || data_addrs[i] != data_addrs[i-1] + 1){
+            extents++;
+        }
+    }
+    return extents;
+}
 
-        return bytes_copied;
+size_t FileSystem::defrag(size_t inumber, size_t max_blocks, size_t *shared) {
+    std::vector<size_t> data_addrs, new_addrs;
+    InodeV2 inode;
 
+    if(shared != NULL){
+        *shared = 0;
+    }
+    size_t extents = fragmentation(inumber);
+    if(extents == (size_t)-1){
+        return -1;
+    }
+    if(extents <= 1){
+        return 0;
     }
+    evict_inode(inumber);
 
-    // Read block and copy to data
-    return -1;
+    PointerTree tree;
+    if(!load_inode(inumber, inode) || !get_data_addrs(inode, data_addrs, &tree)){
+        return -1;
+    }
+    // Moving a block shared with a clone would split it in two, so such a
+    // file stays where it is and the caller is told why
+    size_t nblocks = data_addrs.size();
+    size_t nshared = 0;
+    for(size_t i = 0; i < nblocks; i++){
+        if(refcount(data_addrs[i]) > 1){
+            nshared++;
+        }
+    }
+    if(nshared > 0){
+        if(shared != NULL){
+            *shared = nshared;
+        }
+        return 0;
+    }
+
+    // Leave the leading extent in place if the blocks after it are free, so
+    // a defrag cut short by max_blocks picks up where it stopped; otherwise
+    // block i moves to base + i in a fresh run
+    size_t keep = 1;
+    while(keep < nblocks && data_addrs[keep] == data_addrs[0] + keep){
+        keep++;
+    }
+    size_t base = data_addrs[0];
+    size_t first_moved = keep;
+    if(base + nblocks > FS_Geometry.Blocks || next_refcount(base + keep, false) < base + nblocks){
+        base = find_free_run(nblocks);
+        first_moved = 0;
+        if(base == (size_t)-1){
+            return -1;
+        }
+    }
+    size_t last_moved = first_moved + std::min(nblocks - first_moved, max_blocks);
+
+    // Reserve every destination block up front, so writes made between
+    // batches can never be handed one of them.
+    for(size_t i = first_moved; i < last_moved; i++){
+        set_refcount(base + i, 1);
+    }
+
+    size_t moved = 0;
+    new_addrs = data_addrs;
+
+    for(size_t first = first_moved; first < last_moved; first += DEFRAG_BATCH){
+        size_t count = std::min(last_moved - first, (size_t)DEFRAG_BATCH);
+        bool copied = true;
+
+        // Copy each block before anything points at its new home...
+        for(size_t i = 0; i < count && copied; i++){
+            // Never give corrupt data a fresh checksum
+            copied = read_block(data_addrs[first + i], FS_Data_Block->Data);
+            if(copied){
+                write_block(base + first + i, FS_Data_Block->Data);
+                new_addrs[first + i] = base + first + i;
+            }
+        }
+
+        // ...then switch the pointers over, and only then free the old blocks
+        if(!copied || !set_data_addrs(inode, new_addrs, tree, first, first + count)){
+            // Nothing points at this batch or the ones after it yet
+            for(size_t i = first; i < last_moved; i++){
+                release_block(base + i);
+            }
+            flush_metadata();
+            flush_discards();
+            sync_inode(inumber, true);
+            return -1;
+        }
+        if(!save_inode(inumber, inode)){
+            // The indirect block may already point at the new copies: keep
+            // both and leave the old blocks to fsck
+            flush_metadata();
+            sync_inode(inumber, true);
+            return -1;
+        }
+        for(size_t i = 0; i < count; i++){
+            release_block(data_addrs[first + i]);
+        }
+        flush_metadata();
+        flush_discards();
+        moved += count;
+    }
+
+    // Open handles must pick up the new block map
+    sync_inode(inumber, true);
+    return moved;
 }
 
+// Trim free blocks -------------------------------------------------------------
+
+size_t FileSystem::trim() {
+    size_t trimmed = 0;
+    size_t i = data_start();
+
+    Pending_Discards.clear();
+
+    // Discard every run of free data blocks in one go
+    while(i < FS_Geometry.Blocks){
+        size_t start = next_refcount(i, true);
+        if(start == FS_Geometry.Blocks){
+            break;
+        }
+
+        i = next_refcount(start, false);
+        if(!FS_Disk->discard(start, i - start)){
+            return -1;
+        }
+        trimmed += i - start;
+    }
+
+    return trimmed;
+}
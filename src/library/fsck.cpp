@@ -0,0 +1,604 @@
+// fsck.cpp: Offline file system consistency checker
+
+#include "afs/fsck.h"
+
+#include <algorithm>
+#include <set>
+#include <thread>
+
+#include <stdio.h>
+#include <string.h>
+
+const static uint32_t POINTERS_PER_INODE  = FileSystem::POINTERS_PER_INODE;
+const static uint32_t CHECKSUMS_PER_BLOCK = FileSystem::CHECKSUMS_PER_BLOCK;
+const static uint32_t REFCOUNTS_PER_BLOCK = FileSystem::REFCOUNTS_PER_BLOCK;
+
+// Flag marking an Owners entry as an indirect block
+const static uint32_t INDIRECT_OWNER = 0x80000000;
+
+FileSystemChecker::FileSystemChecker(Disk *disk, size_t threads, bool repair, bool verify_data)
+    : CK_Disk(disk), CK_Threads(threads > 0 ? threads : 1), CK_Repair(repair),
+      CK_VerifyData(verify_data), CK_DataStart(0), Owners(NULL), NextInodeBlock(1) {
+    memset(&CK_Geometry, 0, sizeof(CK_Geometry));
+}
+
+FileSystemChecker::~FileSystemChecker() {
+    delete [] Owners;
+}
+
+// Helpers ---------------------------------------------------------------------
+
+bool FileSystemChecker::valid_data_block(uint64_t blocknum) const {
+    return blocknum >= CK_DataStart && blocknum < CK_Geometry.Blocks;
+}
+
+bool FileSystemChecker::verify_block(Worker &worker, size_t blocknum, const char *data) {
+    if (CK_Geometry.ChecksumBlocks == 0) {
+    	return true;
+    }
+
+    size_t checksum_block = CK_Geometry.InodeBlocks + 1 + blocknum / CHECKSUMS_PER_BLOCK;
+    if (checksum_block != worker.ChecksumBlockNum) {
+    	CK_Disk->read(checksum_block, worker.ChecksumBlock->Data);
+    	worker.ChecksumBlockNum = checksum_block;
+    }
+
+    uint32_t stored = worker.ChecksumBlock->Checksums[blocknum % CHECKSUMS_PER_BLOCK];
+    return stored == 0 || stored == FileSystem::block_checksum(data);
+}
+
+void FileSystemChecker::update_checksum(size_t blocknum, char *data) {
+    if (CK_Geometry.ChecksumBlocks == 0) {
+    	return;
+    }
+
+    Borrowed<Block> checksum_block;
+    size_t checksum_blocknum = CK_Geometry.InodeBlocks + 1 + blocknum / CHECKSUMS_PER_BLOCK;
+    CK_Disk->read(checksum_blocknum, checksum_block->Data);
+    checksum_block->Checksums[blocknum % CHECKSUMS_PER_BLOCK] = FileSystem::block_checksum(data);
+    CK_Disk->write(checksum_blocknum, checksum_block->Data);
+}
+
+// Record ownership of a block; the first claimant wins. Data blocks may be
+// shared between files by clones, but not within a file or with an indirect
+// block. Whether a block shared between files is a clone or a cross-link is
+// settled once the reference counts are known.
+bool FileSystemChecker::claim(Worker &worker, uint32_t inumber, size_t blocknum, size_t index, bool indirect) {
+    uint32_t owner    = (inumber + 1) | (indirect ? INDIRECT_OWNER : 0);
+    uint32_t expected = 0;
+    if (Owners[blocknum].compare_exchange_strong(expected, owner)) {
+    	worker.DataBlocks++;
+    	return true;
+    }
+
+    Problem problem = {SHARED_BLOCK, inumber, blocknum, 0, index};
+    if (!(owner & INDIRECT_OWNER) && !(expected & INDIRECT_OWNER) && expected != owner) {
+    	worker.Shared.push_back(problem);
+    	return true;
+    }
+
+    worker.Problems.push_back(problem);
+    return false;
+}
+
+// Scanning --------------------------------------------------------------------
+
+// Each worker pulls inode blocks off a shared counter until none are left
+void FileSystemChecker::scan(Worker &worker) {
+    Borrowed<Block> inode_block;
+    Inode inode;
+    size_t k;
+
+    while ((k = NextInodeBlock++) <= CK_Geometry.InodeBlocks) {
+    	CK_Disk->read(k, inode_block->Data);
+    	if (!verify_block(worker, k, inode_block->Data)) {
+    	    Problem problem = {BAD_CHECKSUM, 0, k, 0, 0};
+    	    worker.Problems.push_back(problem);
+	}
+
+	for (size_t i = 0; i < CK_Geometry.InodesPerBlock; i++) {
+	    FileSystem::decode_inode(CK_Geometry, *inode_block, i, inode);
+	    if (inode.Valid) {
+	    	scan_inode(worker, (k - 1)*CK_Geometry.InodesPerBlock + i, inode);
+	    }
+	}
+    }
+}
+
+void FileSystemChecker::scan_inode(Worker &worker, uint32_t inumber, Inode &inode) {
+    std::vector<size_t> blocks;
+    Borrowed<Block> data_block;
+    bool end = false;
+
+    worker.Inodes++;
+
+    // Direct pointers, ending at the first empty one
+    for (uint32_t j = 0; j < POINTERS_PER_INODE && !end; j++) {
+    	if (inode.Direct[j] == 0) {
+    	    end = true;
+	} else if (!valid_data_block(inode.Direct[j])) {
+	    Problem problem = {BAD_POINTER, inumber, inode.Direct[j], inode.Size, j};
+	    worker.Problems.push_back(problem);
+	    end = true;
+	} else {
+	    claim(worker, inumber, inode.Direct[j], j, false);
+	    blocks.push_back(inode.Direct[j]);
+	}
+    }
+
+    // Indirect block and the tree of pointers under it
+    if (inode.Indirect != 0) {
+    	if (!valid_data_block(inode.Indirect) || FileSystem::indirect_levels(inode) > FileSystem::max_indirect_levels(CK_Geometry)) {
+    	    Problem problem = {BAD_INDIRECT, inumber, inode.Indirect, inode.Size, POINTERS_PER_INODE};
+    	    worker.Problems.push_back(problem);
+	} else {
+	    scan_pointers(worker, inumber, inode, inode.Indirect, FileSystem::indirect_levels(inode), blocks, end);
+	}
+    }
+
+    // Size against allocated blocks
+    size_t needed = (inode.Size + Disk::BLOCK_SIZE - 1) / Disk::BLOCK_SIZE;
+    if (needed > blocks.size()) {
+    	Problem problem = {SIZE_TOO_LARGE, inumber, 0, inode.Size, blocks.size()};
+    	worker.Problems.push_back(problem);
+    } else if ((needed < blocks.size() && !(inode.Valid & FileSystem::INODE_PREALLOCATED)) || (end && inode.Indirect != 0)) {
+    	Problem problem = {SIZE_TOO_SMALL, inumber, 0, inode.Size, needed};
+    	worker.Problems.push_back(problem);
+    }
+
+    // Optionally read back every data block against its checksum
+    if (CK_VerifyData) {
+    	for (size_t j = 0; j < blocks.size(); j++) {
+    	    CK_Disk->read(blocks[j], data_block->Data);
+    	    if (!verify_block(worker, blocks[j], data_block->Data)) {
+    	    	Problem problem = {BAD_DATA_CHECKSUM, inumber, blocks[j], inode.Size, j};
+    	    	worker.Problems.push_back(problem);
+	    }
+	}
+    }
+}
+
+// Claim a pointer block with levels of pointers under it (1 if it holds data
+// block pointers), and unless the direct pointers already ended, everything
+// under it; returns whether the subtree was full, so the file goes on
+bool FileSystemChecker::scan_pointers(Worker &worker, uint32_t inumber, const Inode &inode, size_t blocknum, size_t levels, std::vector<size_t> &blocks, bool end) {
+    Borrowed<Block> pointer_block;
+
+    if (!claim(worker, inumber, blocknum, blocks.size(), true) || end) {
+    	return false;
+    }
+    CK_Disk->read(blocknum, pointer_block->Data);
+    if (!verify_block(worker, blocknum, pointer_block->Data)) {
+    	Problem problem = {BAD_CHECKSUM, inumber, blocknum, inode.Size, blocks.size()};
+    	worker.Problems.push_back(problem);
+    }
+
+    for (size_t j = 0; j < CK_Geometry.PointersPerBlock; j++) {
+    	uint64_t pointer = FileSystem::get_pointer(CK_Geometry, *pointer_block, j);
+    	if (pointer == 0) {
+    	    return false;
+	}
+    	if (!valid_data_block(pointer)) {
+    	    Problem problem = {levels > 1 ? BAD_INDIRECT : BAD_POINTER, inumber, pointer, inode.Size, blocks.size()};
+    	    worker.Problems.push_back(problem);
+    	    return false;
+	}
+	if (levels > 1) {
+	    if (!scan_pointers(worker, inumber, inode, pointer, levels - 1, blocks, false)) {
+	    	return false;
+	    }
+	} else {
+	    claim(worker, inumber, pointer, blocks.size(), false);
+	    blocks.push_back(pointer);
+	}
+    }
+    return true;
+}
+
+// Repair ----------------------------------------------------------------------
+
+// Clear every pointer from position limit onwards (and any invalid pointer
+// with everything after it); return the number of pointers kept.
+size_t FileSystemChecker::truncate_inode(Inode &inode, size_t limit) {
+    size_t count = 0;
+    bool end = false;
+
+    for (uint32_t j = 0; j < POINTERS_PER_INODE; j++) {
+    	if (end || count >= limit || !valid_data_block(inode.Direct[j])) {
+    	    inode.Direct[j] = 0;
+    	    end = true;
+	} else {
+	    count++;
+	}
+    }
+
+    if (inode.Indirect != 0) {
+    	if (end || count >= limit || !valid_data_block(inode.Indirect) ||
+    	    FileSystem::indirect_levels(inode) > FileSystem::max_indirect_levels(CK_Geometry) ||
+    	    !truncate_pointers(inode.Indirect, FileSystem::indirect_levels(inode), limit, count, end)) {
+    	    inode.Indirect = 0;
+    	    inode.Levels = 0;
+	}
+    }
+
+    return count;
+}
+
+// Truncate the pointers under one pointer block, rewriting it if any are
+// left; returns whether any are
+bool FileSystemChecker::truncate_pointers(size_t blocknum, size_t levels, size_t limit, size_t &count, bool &end) {
+    Borrowed<Block> pointer_block;
+    bool kept = false;
+
+    CK_Disk->read(blocknum, pointer_block->Data);
+    for (size_t j = 0; j < CK_Geometry.PointersPerBlock; j++) {
+    	uint64_t pointer = FileSystem::get_pointer(CK_Geometry, *pointer_block, j);
+    	if (end || count >= limit || !valid_data_block(pointer) ||
+    	    (levels > 1 && !truncate_pointers(pointer, levels - 1, limit, count, end))) {
+    	    FileSystem::set_pointer(CK_Geometry, *pointer_block, j, 0);
+    	    end = true;
+	} else {
+	    if (levels == 1) {
+	    	count++;
+	    }
+	    kept = true;
+	}
+    }
+
+    if (kept) {
+    	update_checksum(blocknum, pointer_block->Data);
+    	CK_Disk->write(blocknum, pointer_block->Data);
+    }
+    return kept;
+}
+
+std::vector<size_t> FileSystemChecker::block_list(uint32_t inumber) {
+    std::vector<size_t> blocks;
+    Borrowed<Block> inode_block;
+    Inode inode;
+
+    CK_Disk->read(1 + inumber / CK_Geometry.InodesPerBlock, inode_block->Data);
+    FileSystem::decode_inode(CK_Geometry, *inode_block, inumber % CK_Geometry.InodesPerBlock, inode);
+
+    for (uint32_t j = 0; j < POINTERS_PER_INODE; j++) {
+    	if (!valid_data_block(inode.Direct[j])) {
+    	    return blocks;
+	}
+	blocks.push_back(inode.Direct[j]);
+    }
+
+    if (valid_data_block(inode.Indirect) && FileSystem::indirect_levels(inode) <= FileSystem::max_indirect_levels(CK_Geometry)) {
+    	walk_pointers(inode.Indirect, FileSystem::indirect_levels(inode), blocks, NULL);
+    }
+    return blocks;
+}
+
+// Follow the pointers under one pointer block the way the file system does,
+// adding data blocks to blocks and counting every block in references if
+// given; returns whether the subtree was full
+bool FileSystemChecker::walk_pointers(size_t blocknum, size_t levels, std::vector<size_t> &blocks, std::vector<uint32_t> *references) {
+    Borrowed<Block> pointer_block;
+
+    CK_Disk->read(blocknum, pointer_block->Data);
+    for (size_t j = 0; j < CK_Geometry.PointersPerBlock; j++) {
+    	uint64_t pointer = FileSystem::get_pointer(CK_Geometry, *pointer_block, j);
+    	if (!valid_data_block(pointer)) {
+    	    return false;
+	}
+	if (references != NULL) {
+	    (*references)[pointer]++;
+	}
+	if (levels > 1) {
+	    if (!walk_pointers(pointer, levels - 1, blocks, references)) {
+	    	return false;
+	    }
+	} else {
+	    blocks.push_back(pointer);
+	}
+    }
+    return true;
+}
+
+void FileSystemChecker::repair_inode(uint32_t inumber, size_t truncate_at) {
+    Borrowed<Block> inode_block;
+    Inode inode;
+    size_t k = 1 + inumber / CK_Geometry.InodesPerBlock;
+
+    CK_Disk->read(k, inode_block->Data);
+    FileSystem::decode_inode(CK_Geometry, *inode_block, inumber % CK_Geometry.InodesPerBlock, inode);
+
+    // Drop pointers past the truncation point, clamp the size to what is
+    // left, then drop any blocks past the end of the file. Pointer blocks
+    // are rewritten as they are cut back.
+    size_t count = truncate_inode(inode, truncate_at);
+    if (inode.Size > count*Disk::BLOCK_SIZE) {
+    	inode.Size = count*Disk::BLOCK_SIZE;
+    }
+    truncate_inode(inode, (inode.Size + Disk::BLOCK_SIZE - 1) / Disk::BLOCK_SIZE);
+    FileSystem::encode_inode(CK_Geometry, *inode_block, inumber % CK_Geometry.InodesPerBlock, inode);
+
+    update_checksum(k, inode_block->Data);
+    CK_Disk->write(k, inode_block->Data);
+}
+
+// Reference counts ------------------------------------------------------------
+
+// Count the pointers to every block, the way the file system releases them
+void FileSystemChecker::count_references() {
+    Borrowed<Block> inode_block;
+    Inode inode;
+    std::vector<size_t> blocks;
+
+    References.assign(CK_Geometry.Blocks, 0);
+    for (size_t k = 1; k <= CK_Geometry.InodeBlocks; k++) {
+    	CK_Disk->read(k, inode_block->Data);
+    	for (size_t i = 0; i < CK_Geometry.InodesPerBlock; i++) {
+    	    FileSystem::decode_inode(CK_Geometry, *inode_block, i, inode);
+    	    if (!inode.Valid) {
+    	    	continue;
+	    }
+
+	    uint32_t j = 0;
+	    for (; j < POINTERS_PER_INODE && valid_data_block(inode.Direct[j]); j++) {
+	    	References[inode.Direct[j]]++;
+	    }
+	    if (!valid_data_block(inode.Indirect)) {
+	    	continue;
+	    }
+	    References[inode.Indirect]++;
+	    if (j < POINTERS_PER_INODE || FileSystem::indirect_levels(inode) > FileSystem::max_indirect_levels(CK_Geometry)) {
+	    	continue;
+	    }
+
+	    blocks.clear();
+	    walk_pointers(inode.Indirect, FileSystem::indirect_levels(inode), blocks, &References);
+	}
+    }
+}
+
+// Read the on-disk table and compare it against the counted pointers, over
+// the data region. A block with more pointers than its count records was
+// cross-linked rather than cloned: that is reported against the inodes
+// instead.
+void FileSystemChecker::check_references(std::vector<Problem> &problems) {
+    Worker worker;
+    Borrowed<Block> table_block;
+    size_t table_start = 1 + CK_Geometry.InodeBlocks + CK_Geometry.ChecksumBlocks;
+
+    Stored.assign(CK_Geometry.Blocks, 0);
+    worker.ChecksumBlockNum = -1;
+    for (size_t t = 0; t < CK_Geometry.RefcountBlocks; t++) {
+    	CK_Disk->read(table_start + t, table_block->Data);
+    	if (!verify_block(worker, table_start + t, table_block->Data)) {
+    	    Problem problem = {BAD_CHECKSUM, 0, table_start + t, 0, 0};
+    	    problems.push_back(problem);
+	}
+
+	for (size_t i = 0; i < REFCOUNTS_PER_BLOCK; i++) {
+	    size_t blocknum = t*REFCOUNTS_PER_BLOCK + i;
+	    if (blocknum < CK_DataStart || blocknum >= CK_Geometry.Blocks) {
+	    	continue;
+	    }
+	    Stored[blocknum] = table_block->Refcounts[i];
+	    if (Stored[blocknum] != References[blocknum] && !cross_linked(blocknum)) {
+	    	Problem problem = {BAD_REFCOUNT, ~0u, blocknum, Stored[blocknum], blocknum};
+	    	problems.push_back(problem);
+	    }
+	}
+    }
+}
+
+// Only a clone shares a block between files, and only version 2 records
+// clones: anywhere else a shared block is a cross-link
+bool FileSystemChecker::cross_linked(size_t blocknum) const {
+    return CK_Geometry.Version != 2 || (References[blocknum] > 1 && Stored[blocknum] < References[blocknum]);
+}
+
+// Rewrite every table block that disagrees with the (repaired) inodes
+void FileSystemChecker::repair_references() {
+    Worker worker;
+    Borrowed<Block> table_block;
+    size_t table_start = 1 + CK_Geometry.InodeBlocks + CK_Geometry.ChecksumBlocks;
+
+    count_references();
+    worker.ChecksumBlockNum = -1;
+    for (size_t t = 0; t < CK_Geometry.RefcountBlocks; t++) {
+    	CK_Disk->read(table_start + t, table_block->Data);
+    	bool dirty = !verify_block(worker, table_start + t, table_block->Data);
+	for (size_t i = 0; i < REFCOUNTS_PER_BLOCK; i++) {
+	    size_t blocknum = t*REFCOUNTS_PER_BLOCK + i;
+	    if (blocknum < CK_DataStart || blocknum >= CK_Geometry.Blocks) {
+	    	continue;
+	    }
+	    if (table_block->Refcounts[i] != References[blocknum]) {
+	    	table_block->Refcounts[i] = References[blocknum];
+	    	dirty = true;
+	    }
+	}
+
+	if (dirty) {
+	    update_checksum(table_start + t, table_block->Data);
+	    CK_Disk->write(table_start + t, table_block->Data);
+	}
+    }
+}
+
+// Check -----------------------------------------------------------------------
+
+FileSystemChecker::Report FileSystemChecker::check() {
+    Report report = {0, 0, 0, 0, 0, 0};
+    Borrowed<Block> block;
+
+    // Superblock
+    CK_Disk->read(0, block->Data);
+    bool valid = FileSystem::read_geometry(*block, CK_Geometry);
+
+    printf("SuperBlock:\n");
+    if (valid && CK_Geometry.BlockSize != Disk::BLOCK_SIZE) {
+    	printf("    block size %lu does not match %lu\n", CK_Geometry.BlockSize, Disk::BLOCK_SIZE);
+    	report.Errors++;
+    	return report;
+    }
+    if (!valid ||
+    	CK_Geometry.Blocks == 0 || CK_Geometry.Blocks > CK_Disk->size() ||
+    	CK_Geometry.Inodes != CK_Geometry.InodeBlocks*CK_Geometry.InodesPerBlock ||
+    	1 + CK_Geometry.InodeBlocks + CK_Geometry.ChecksumBlocks + CK_Geometry.RefcountBlocks > CK_Geometry.Blocks ||
+    	(CK_Geometry.Version == 2 && (CK_Geometry.ChecksumBlocks == 0 ||
+    	 CK_Geometry.RefcountBlocks < (CK_Geometry.Blocks + REFCOUNTS_PER_BLOCK - 1) / REFCOUNTS_PER_BLOCK))) {
+    	printf("    superblock is invalid\n");
+    	report.Errors++;
+    	return report;
+    }
+    if (CK_Geometry.Inodes >= INDIRECT_OWNER) {
+    	printf("    %lu inodes is more than afsck can check\n", CK_Geometry.Inodes);
+    	report.Errors++;
+    	return report;
+    }
+    printf("    %lu blocks\n"	  , CK_Geometry.Blocks);
+    printf("    %lu inode blocks\n"	  , CK_Geometry.InodeBlocks);
+    printf("    %lu inodes\n"	  , CK_Geometry.Inodes);
+    printf("    %lu checksum blocks\n", CK_Geometry.ChecksumBlocks);
+    if (CK_Geometry.RefcountBlocks) {
+    	printf("    %lu refcount blocks\n", CK_Geometry.RefcountBlocks);
+    }
+
+    CK_DataStart = 1 + CK_Geometry.InodeBlocks + CK_Geometry.ChecksumBlocks + CK_Geometry.RefcountBlocks;
+    Owners = new std::atomic<uint32_t>[CK_Geometry.Blocks];
+    for (size_t i = 0; i < CK_Geometry.Blocks; i++) {
+    	Owners[i].store(0);
+    }
+
+    // Scan inode blocks in parallel
+    std::vector<Worker> workers(CK_Threads);
+    std::vector<std::thread> threads;
+    for (size_t t = 0; t < CK_Threads; t++) {
+    	workers[t].Inodes = 0;
+    	workers[t].DataBlocks = 0;
+    	workers[t].ChecksumBlockNum = -1;
+    }
+    for (size_t t = 0; t < CK_Threads; t++) {
+    	threads.push_back(std::thread(&FileSystemChecker::scan, this, std::ref(workers[t])));
+    }
+    for (size_t t = 0; t < CK_Threads; t++) {
+    	threads[t].join();
+    }
+
+    std::vector<Problem> problems, shared;
+    for (size_t t = 0; t < CK_Threads; t++) {
+    	report.Inodes     += workers[t].Inodes;
+    	report.DataBlocks += workers[t].DataBlocks;
+    	problems.insert(problems.end(), workers[t].Problems.begin(), workers[t].Problems.end());
+    	shared.insert(shared.end(), workers[t].Shared.begin(), workers[t].Shared.end());
+    }
+
+    // Version 2 also keeps a table of reference counts to check
+    if (CK_Geometry.Version == 2) {
+    	count_references();
+    	check_references(problems);
+    }
+    for (size_t s = 0; s < shared.size(); s++) {
+    	if (cross_linked(shared[s].Block)) {
+    	    problems.push_back(shared[s]);
+	} else {
+	    report.SharedBlocks++;
+	}
+    }
+    std::sort(problems.begin(), problems.end());
+
+    for (size_t i = CK_DataStart; i < CK_Geometry.Blocks; i++) {
+    	if (Owners[i].load() == 0) {
+    	    report.FreeBlocks++;
+	}
+    }
+
+    // Report problems and work out the repairs: each affected inode is cut
+    // back to the first bad pointer, and a shared block stays with the
+    // lowest numbered owner. A pointer block that fails its checksum is cut
+    // off with everything under it, and the reference count table is
+    // rebuilt from the pointers. An inode block that fails its checksum is
+    // left as it is, along with the inodes in it: rewriting it would make
+    // its contents pass as valid.
+    std::map<uint32_t, size_t> truncations;
+    std::set<size_t> bad_inode_blocks;
+    std::vector<bool> repairable(problems.size(), true);
+
+    for (size_t p = 0; p < problems.size(); p++) {
+    	if (problems[p].Kind == BAD_CHECKSUM && problems[p].Block <= CK_Geometry.InodeBlocks) {
+    	    bad_inode_blocks.insert(problems[p].Block);
+	}
+    }
+
+    for (size_t p = 0; p < problems.size(); p++) {
+    	Problem &problem = problems[p];
+    	uint32_t owner, target = problem.Inumber;
+    	size_t index = problem.Index;
+
+    	switch (problem.Kind) {
+    	    case BAD_POINTER:
+    	    	printf("inode %u: block %lu is out of range\n", problem.Inumber, problem.Block);
+    	    	break;
+	    case BAD_INDIRECT:
+	    	printf("inode %u: indirect block %lu is out of range\n", problem.Inumber, problem.Block);
+	    	break;
+	    case SHARED_BLOCK:
+	    	owner = (Owners[problem.Block].load() & ~INDIRECT_OWNER) - 1;
+	    	printf("inode %u: block %lu is also owned by inode %u\n", problem.Inumber, problem.Block, owner);
+	    	if (owner > problem.Inumber) {
+	    	    std::vector<size_t> blocks = block_list(owner);
+	    	    target = owner;
+	    	    index  = std::find(blocks.begin(), blocks.end(), problem.Block) - blocks.begin();
+		}
+	    	break;
+	    case SIZE_TOO_LARGE:
+	    	printf("inode %u: size %lu bytes exceeds %lu allocated blocks\n", problem.Inumber, problem.Size, problem.Index);
+	    	break;
+	    case SIZE_TOO_SMALL:
+	    	printf("inode %u: blocks allocated past size %lu bytes\n", problem.Inumber, problem.Size);
+	    	break;
+	    case BAD_CHECKSUM:
+	    	printf("block %lu: checksum mismatch\n", problem.Block);
+	    	break;
+	    case BAD_DATA_CHECKSUM:
+	    	printf("inode %u: data block %lu checksum mismatch\n", problem.Inumber, problem.Block);
+	    	break;
+	    case BAD_REFCOUNT:
+	    	printf("block %lu: reference count %lu should be %u\n", problem.Block, problem.Size, References[problem.Block]);
+	    	break;
+	}
+
+	report.Errors++;
+	if (problem.Kind == BAD_DATA_CHECKSUM || (problem.Kind == BAD_CHECKSUM && problem.Block <= CK_Geometry.InodeBlocks)) {
+	    repairable[p] = false;
+	    continue;
+	}
+	if (problem.Kind == BAD_REFCOUNT || (problem.Kind == BAD_CHECKSUM && problem.Block < CK_DataStart)) {
+	    continue;
+	}
+	if (bad_inode_blocks.count(1 + target / CK_Geometry.InodesPerBlock)) {
+	    repairable[p] = false;
+	    continue;
+	}
+	if (truncations.count(target) == 0 || truncations[target] > index) {
+	    truncations[target] = index;
+	}
+    }
+
+    printf("%lu inodes, %lu data blocks, %lu shared references, %lu free blocks\n", report.Inodes, report.DataBlocks, report.SharedBlocks, report.FreeBlocks);
+
+    if (CK_Repair) {
+    	for (std::map<uint32_t, size_t>::iterator it = truncations.begin(); it != truncations.end(); it++) {
+    	    repair_inode(it->first, it->second);
+	}
+	if (CK_Geometry.Version == 2) {
+	    repair_references();
+	}
+	for (size_t p = 0; p < problems.size(); p++) {
+	    if (repairable[p]) {
+	    	report.Repaired++;
+	    }
+	}
+    }
+
+    printf("%lu errors, %lu repaired\n", report.Errors, report.Repaired);
+    return report;
+}
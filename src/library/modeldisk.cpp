@@ -0,0 +1,65 @@
+// modeldisk.cpp: In-memory disk with a simulated device latency model
+
+#include "afs/modeldisk.h"
+
+#include <cmath>
+
+#include <stdio.h>
+#include <string.h>
+
+// Models ---------------------------------------------------------------------
+
+//                                 Name   Overhead SeekTime Rotation Bandwidth Channels
+const DiskModel DiskModel::HDD = { "hdd", 50,      15000,   4170,    160,      1 };
+const DiskModel DiskModel::SSD = { "ssd", 80,      0,       0,       250,      8 };
+
+const DiskModel *DiskModel::find(const char *name) {
+    if (strcmp(name, HDD.Name) == 0) {
+    	return &HDD;
+    }
+    if (strcmp(name, SSD.Name) == 0) {
+    	return &SSD;
+    }
+    return NULL;
+}
+
+// ModelDisk ------------------------------------------------------------------
+
+ModelDisk::~ModelDisk() {
+    if (size() > 0) {
+    	printf("%.3f seconds of simulated %s time\n", elapsed(), Model.Name);
+    }
+}
+
+double ModelDisk::elapsed() {
+    std::lock_guard<std::mutex> guard(Lock);
+    return Clock / 1e6;
+}
+
+void ModelDisk::charge(size_t blocknum, size_t nblocks) {
+    std::lock_guard<std::mutex> guard(Lock);
+
+    Clock += Model.Overhead;
+
+    // Seek time grows with the square root of the distance travelled
+    if (Model.SeekTime > 0 && blocknum != Head) {
+    	double distance = blocknum > Head ? blocknum - Head : Head - blocknum;
+    	Clock += Model.SeekTime*std::sqrt(distance / size()) + Model.Rotation;
+    }
+
+    // Each channel moves its share of the request at the channel bandwidth
+    size_t rounds = (nblocks + Model.Channels - 1) / Model.Channels;
+    Clock += rounds*BLOCK_SIZE / (Model.Bandwidth*1024*1024) * 1e6;
+
+    Head = blocknum + nblocks;
+}
+
+void ModelDisk::read_blocks(size_t blocknum, size_t nblocks, char *data) {
+    charge(blocknum, nblocks);
+    RamDisk::read_blocks(blocknum, nblocks, data);
+}
+
+void ModelDisk::write_blocks(size_t blocknum, size_t nblocks, char *data) {
+    charge(blocknum, nblocks);
+    RamDisk::write_blocks(blocknum, nblocks, data);
+}
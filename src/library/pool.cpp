@@ -0,0 +1,52 @@
+// pool.cpp: Aligned block buffer pool
+
+#include "afs/pool.h"
+
+#include <new>
+
+#include <stdlib.h>
+
+BlockPool::~BlockPool() {
+    for (size_t a = 0; a < Arenas.size(); a++) {
+    	free(Arenas[a]);
+    }
+}
+
+char *BlockPool::acquire() {
+    std::lock_guard<std::mutex> guard(Lock);
+
+    if (Free.empty()) {
+    	void *arena;
+    	if (posix_memalign(&arena, ALIGNMENT, ARENA_BLOCKS*STRIDE) != 0) {
+    	    throw std::bad_alloc();
+	}
+	Arenas.push_back((char *)arena);
+	for (size_t b = ARENA_BLOCKS; b > 0; b--) {
+	    Free.push_back((char *)arena + (b - 1)*STRIDE);
+	}
+    }
+
+    char *buffer = Free.back();
+    Free.pop_back();
+    return buffer;
+}
+
+void BlockPool::release(char *buffer) {
+    std::lock_guard<std::mutex> guard(Lock);
+    Free.push_back(buffer);
+}
+
+size_t BlockPool::allocated() {
+    std::lock_guard<std::mutex> guard(Lock);
+    return Arenas.size()*ARENA_BLOCKS;
+}
+
+size_t BlockPool::borrowed() {
+    std::lock_guard<std::mutex> guard(Lock);
+    return Arenas.size()*ARENA_BLOCKS - Free.size();
+}
+
+BlockPool &BlockPool::shared() {
+    static BlockPool pool;
+    return pool;
+}
@@ -0,0 +1,99 @@
+// ramdisk.cpp: In-memory disk
+
+#include "afs/ramdisk.h"
+#include "afs/pool.h"
+
+#include <stdexcept>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+void RamDisk::open(size_t nblocks) {
+    Data.clear();
+    Data.resize(nblocks);
+    opened(nblocks);
+}
+
+void RamDisk::load(const char *path, size_t nblocks) {
+    int fd = ::open(path, O_RDONLY);
+    if (fd < 0) {
+    	char what[BUFSIZ];
+    	snprintf(what, BUFSIZ, "Unable to open %s: %s", path, strerror(errno));
+    	throw std::runtime_error(what);
+    }
+
+    // Only blocks with data take up memory, and holes in sparse images
+    // are skipped without reading them
+    Data.clear();
+    Data.resize(nblocks);
+    Borrowed<char[BLOCK_SIZE]> buffer;
+    char *block = *buffer;
+    off_t start = 0;
+    while ((start = lseek(fd, start, SEEK_DATA)) >= 0 && (size_t)start / BLOCK_SIZE < nblocks) {
+    	off_t  end = lseek(fd, start, SEEK_HOLE);
+    	size_t b   = start / BLOCK_SIZE;
+    	for (; b < nblocks && (off_t)(b*BLOCK_SIZE) < end; b++) {
+    	    ssize_t result = ::pread(fd, block, BLOCK_SIZE, (off_t)b*BLOCK_SIZE);
+    	    if (result < 0) {
+    	    	char what[BUFSIZ];
+    	    	snprintf(what, BUFSIZ, "Unable to read %s: %s", path, strerror(errno));
+    	    	close(fd);
+    	    	throw std::runtime_error(what);
+	    }
+	    memset(block + result, 0, BLOCK_SIZE - result);
+
+	    for (size_t i = 0; i < BLOCK_SIZE; i++) {
+	    	if (block[i]) {
+	    	    Data[b].reset(new char[BLOCK_SIZE]);
+	    	    memcpy(Data[b].get(), block, BLOCK_SIZE);
+	    	    break;
+		}
+	    }
+	}
+	start = b*BLOCK_SIZE;
+    }
+    close(fd);
+
+    opened(nblocks);
+}
+
+size_t RamDisk::resident() const {
+    size_t count = 0;
+    for (size_t b = 0; b < Data.size(); b++) {
+    	if (Data[b]) {
+    	    count++;
+	}
+    }
+    return count;
+}
+
+void RamDisk::read_blocks(size_t blocknum, size_t nblocks, char *data) {
+    for (size_t b = 0; b < nblocks; b++) {
+    	if (Data[blocknum + b]) {
+    	    memcpy(data + b*BLOCK_SIZE, Data[blocknum + b].get(), BLOCK_SIZE);
+	} else {
+	    memset(data + b*BLOCK_SIZE, 0, BLOCK_SIZE);
+	}
+    }
+}
+
+void RamDisk::write_blocks(size_t blocknum, size_t nblocks, char *data) {
+    // Distinct blocks have distinct slots, so concurrent writers of
+    // different blocks never touch the same memory
+    for (size_t b = 0; b < nblocks; b++) {
+    	if (!Data[blocknum + b]) {
+    	    Data[blocknum + b].reset(new char[BLOCK_SIZE]);
+	}
+	memcpy(Data[blocknum + b].get(), data + b*BLOCK_SIZE, BLOCK_SIZE);
+    }
+}
+
+bool RamDisk::discard_blocks(size_t blocknum, size_t nblocks) {
+    for (size_t b = 0; b < nblocks; b++) {
+    	Data[blocknum + b].reset();
+    }
+    return true;
+}
@@ -0,0 +1,367 @@
+// scan.cpp: Vectorized metadata scans
+
+#include "afs/scan.h"
+
+#include <atomic>
+
+#include <stdlib.h>
+#include <string.h>
+
+#if defined(__x86_64__)
+#include <immintrin.h>
+#endif
+
+// Scalar implementation -------------------------------------------------------
+
+static size_t first_zero32_scalar(const uint32_t *values, size_t count) {
+    size_t i = 0;
+    while (i < count && values[i] != 0) {
+    	i++;
+    }
+    return i;
+}
+
+static size_t first_nonzero32_scalar(const uint32_t *values, size_t count) {
+    size_t i = 0;
+    while (i < count && values[i] == 0) {
+    	i++;
+    }
+    return i;
+}
+
+static size_t first_zero64_scalar(const uint64_t *values, size_t count) {
+    size_t i = 0;
+    while (i < count && values[i] != 0) {
+    	i++;
+    }
+    return i;
+}
+
+// Vector versions finish the last few values here, from start
+static size_t nonzero32_from(const uint32_t *values, size_t start, size_t count, uint32_t *positions) {
+    size_t found = 0;
+    for (size_t i = start; i < count; i++) {
+    	if (values[i] != 0) {
+    	    positions[found++] = i;
+	}
+    }
+    return found;
+}
+
+static size_t nonzero32_scalar(const uint32_t *values, size_t count, uint32_t *positions) {
+    return nonzero32_from(values, 0, count, positions);
+}
+
+static size_t count_nonzero32_scalar(const uint32_t *values, size_t count) {
+    size_t found = 0;
+    for (size_t i = 0; i < count; i++) {
+    	found += values[i] != 0;
+    }
+    return found;
+}
+
+static size_t valid_from(const uint32_t *words, size_t start, size_t count, size_t stride, uint32_t *positions) {
+    size_t found = 0;
+    for (size_t i = start; i < count; i++) {
+    	if (words[i*stride] != 0) {
+    	    positions[found++] = i;
+	}
+    }
+    return found;
+}
+
+static size_t valid_scalar(const uint32_t *words, size_t count, size_t stride, uint32_t *positions) {
+    return valid_from(words, 0, count, stride, positions);
+}
+
+// Store the index of each set bit of mask, offset by base
+static inline size_t store_bits(uint32_t mask, size_t base, uint32_t *positions) {
+    size_t found = 0;
+    while (mask) {
+    	positions[found++] = base + __builtin_ctz(mask);
+    	mask &= mask - 1;
+    }
+    return found;
+}
+
+#if defined(__x86_64__)
+
+// SSE2 implementation: 16 words at a time --------------------------------------
+
+// Bit i is set if p[i] is zero
+static inline uint32_t zero_mask32_sse2(const uint32_t *p) {
+    const __m128i zero = _mm_setzero_si128();
+    uint32_t mask = 0;
+    for (int k = 0; k < 4; k++) {
+    	__m128i equal = _mm_cmpeq_epi32(_mm_loadu_si128((const __m128i *)(p + 4*k)), zero);
+    	mask |= (uint32_t)_mm_movemask_ps(_mm_castsi128_ps(equal)) << (4*k);
+    }
+    return mask;
+}
+
+// Bit i is set if p[i] is zero (8 values)
+static inline uint32_t zero_mask64_sse2(const uint64_t *p) {
+    const __m128i zero = _mm_setzero_si128();
+    uint32_t mask = 0;
+    for (int k = 0; k < 4; k++) {
+    	__m128i equal = _mm_cmpeq_epi32(_mm_loadu_si128((const __m128i *)(p + 2*k)), zero);
+    	equal = _mm_and_si128(equal, _mm_shuffle_epi32(equal, _MM_SHUFFLE(2, 3, 0, 1)));
+    	mask |= (uint32_t)_mm_movemask_pd(_mm_castsi128_pd(equal)) << (2*k);
+    }
+    return mask;
+}
+
+static size_t first_zero32_sse2(const uint32_t *values, size_t count) {
+    size_t i = 0;
+    for (; i + 16 <= count; i += 16) {
+    	uint32_t mask = zero_mask32_sse2(values + i);
+    	if (mask) {
+    	    return i + __builtin_ctz(mask);
+	}
+    }
+    return i + first_zero32_scalar(values + i, count - i);
+}
+
+static size_t first_nonzero32_sse2(const uint32_t *values, size_t count) {
+    size_t i = 0;
+    for (; i + 16 <= count; i += 16) {
+    	uint32_t mask = ~zero_mask32_sse2(values + i) & 0xffff;
+    	if (mask) {
+    	    return i + __builtin_ctz(mask);
+	}
+    }
+    return i + first_nonzero32_scalar(values + i, count - i);
+}
+
+static size_t first_zero64_sse2(const uint64_t *values, size_t count) {
+    size_t i = 0;
+    for (; i + 8 <= count; i += 8) {
+    	uint32_t mask = zero_mask64_sse2(values + i);
+    	if (mask) {
+    	    return i + __builtin_ctz(mask);
+	}
+    }
+    return i + first_zero64_scalar(values + i, count - i);
+}
+
+static size_t nonzero32_sse2(const uint32_t *values, size_t count, uint32_t *positions) {
+    size_t found = 0, i = 0;
+    for (; i + 16 <= count; i += 16) {
+    	found += store_bits(~zero_mask32_sse2(values + i) & 0xffff, i, positions + found);
+    }
+    return found + nonzero32_from(values, i, count, positions + found);
+}
+
+static size_t count_nonzero32_sse2(const uint32_t *values, size_t count) {
+    size_t found = 0, i = 0;
+    for (; i + 16 <= count; i += 16) {
+    	found += 16 - __builtin_popcount(zero_mask32_sse2(values + i));
+    }
+    return found + count_nonzero32_scalar(values + i, count - i);
+}
+
+static size_t valid_sse2(const uint32_t *words, size_t count, size_t stride, uint32_t *positions) {
+    const __m128i zero = _mm_setzero_si128();
+    size_t found = 0, i = 0;
+    for (; i + 4 <= count; i += 4) {
+    	const uint32_t *p = words + i*stride;
+    	__m128i first = _mm_set_epi32(p[3*stride], p[2*stride], p[stride], p[0]);
+    	uint32_t zero_mask = _mm_movemask_ps(_mm_castsi128_ps(_mm_cmpeq_epi32(first, zero)));
+    	found += store_bits(~zero_mask & 0xf, i, positions + found);
+    }
+    return found + valid_from(words, i, count, stride, positions + found);
+}
+
+// AVX2 implementation: 32 words at a time --------------------------------------
+
+__attribute__((target("avx2")))
+static inline uint32_t zero_mask32_avx2(const uint32_t *p) {
+    const __m256i zero = _mm256_setzero_si256();
+    uint32_t mask = 0;
+    for (int k = 0; k < 4; k++) {
+    	__m256i equal = _mm256_cmpeq_epi32(_mm256_loadu_si256((const __m256i *)(p + 8*k)), zero);
+    	mask |= (uint32_t)_mm256_movemask_ps(_mm256_castsi256_ps(equal)) << (8*k);
+    }
+    return mask;
+}
+
+// Bit i is set if p[i] is zero (16 values)
+__attribute__((target("avx2")))
+static inline uint32_t zero_mask64_avx2(const uint64_t *p) {
+    const __m256i zero = _mm256_setzero_si256();
+    uint32_t mask = 0;
+    for (int k = 0; k < 4; k++) {
+    	__m256i equal = _mm256_cmpeq_epi64(_mm256_loadu_si256((const __m256i *)(p + 4*k)), zero);
+    	mask |= (uint32_t)_mm256_movemask_pd(_mm256_castsi256_pd(equal)) << (4*k);
+    }
+    return mask;
+}
+
+__attribute__((target("avx2")))
+static size_t first_zero32_avx2(const uint32_t *values, size_t count) {
+    size_t i = 0;
+    for (; i + 32 <= count; i += 32) {
+    	uint32_t mask = zero_mask32_avx2(values + i);
+    	if (mask) {
+    	    return i + __builtin_ctz(mask);
+	}
+    }
+    return i + first_zero32_scalar(values + i, count - i);
+}
+
+__attribute__((target("avx2")))
+static size_t first_nonzero32_avx2(const uint32_t *values, size_t count) {
+    size_t i = 0;
+    for (; i + 32 <= count; i += 32) {
+    	uint32_t mask = ~zero_mask32_avx2(values + i);
+    	if (mask) {
+    	    return i + __builtin_ctz(mask);
+	}
+    }
+    return i + first_nonzero32_scalar(values + i, count - i);
+}
+
+__attribute__((target("avx2")))
+static size_t first_zero64_avx2(const uint64_t *values, size_t count) {
+    size_t i = 0;
+    for (; i + 16 <= count; i += 16) {
+    	uint32_t mask = zero_mask64_avx2(values + i);
+    	if (mask) {
+    	    return i + __builtin_ctz(mask);
+	}
+    }
+    return i + first_zero64_scalar(values + i, count - i);
+}
+
+__attribute__((target("avx2")))
+static size_t nonzero32_avx2(const uint32_t *values, size_t count, uint32_t *positions) {
+    size_t found = 0, i = 0;
+    for (; i + 32 <= count; i += 32) {
+    	found += store_bits(~zero_mask32_avx2(values + i), i, positions + found);
+    }
+    return found + nonzero32_from(values, i, count, positions + found);
+}
+
+__attribute__((target("avx2,popcnt")))
+static size_t count_nonzero32_avx2(const uint32_t *values, size_t count) {
+    size_t found = 0, i = 0;
+    for (; i + 32 <= count; i += 32) {
+    	found += 32 - __builtin_popcount(zero_mask32_avx2(values + i));
+    }
+    return found + count_nonzero32_scalar(values + i, count - i);
+}
+
+__attribute__((target("avx2")))
+static size_t valid_avx2(const uint32_t *words, size_t count, size_t stride, uint32_t *positions) {
+    const __m256i zero  = _mm256_setzero_si256();
+    const __m256i index = _mm256_mullo_epi32(_mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7), _mm256_set1_epi32(stride));
+    size_t found = 0, i = 0;
+    for (; i + 8 <= count; i += 8) {
+    	__m256i first = _mm256_i32gather_epi32((const int *)(words + i*stride), index, 4);
+    	uint32_t zero_mask = _mm256_movemask_ps(_mm256_castsi256_ps(_mm256_cmpeq_epi32(first, zero)));
+    	found += store_bits(~zero_mask & 0xff, i, positions + found);
+    }
+    return found + valid_from(words, i, count, stride, positions + found);
+}
+
+#endif
+
+// Dispatch --------------------------------------------------------------------
+
+struct Scanner {
+    const char *Name;
+    size_t (*FirstZero32)(const uint32_t *, size_t);
+    size_t (*FirstNonzero32)(const uint32_t *, size_t);
+    size_t (*FirstZero64)(const uint64_t *, size_t);
+    size_t (*Nonzero32)(const uint32_t *, size_t, uint32_t *);
+    size_t (*CountNonzero32)(const uint32_t *, size_t);
+    size_t (*Valid)(const uint32_t *, size_t, size_t, uint32_t *);
+};
+
+static const Scanner Scanners[] = {
+#if defined(__x86_64__)
+    { "avx2", first_zero32_avx2, first_nonzero32_avx2, first_zero64_avx2, nonzero32_avx2, count_nonzero32_avx2, valid_avx2 },
+    { "sse2", first_zero32_sse2, first_nonzero32_sse2, first_zero64_sse2, nonzero32_sse2, count_nonzero32_sse2, valid_sse2 },
+#endif
+    { "scalar", first_zero32_scalar, first_nonzero32_scalar, first_zero64_scalar, nonzero32_scalar, count_nonzero32_scalar, valid_scalar },
+};
+
+static bool scan_supported(const Scanner &scanner) {
+#if defined(__x86_64__)
+    __builtin_cpu_init();
+    if (strcmp(scanner.Name, "avx2") == 0) {
+    	return __builtin_cpu_supports("avx2") && __builtin_cpu_supports("popcnt");
+    }
+#endif
+    return true;
+}
+
+// The implementation named by $AFS_SCAN, or else the best one the CPU
+// supports
+static const Scanner *scan_default() {
+    const Scanner *scanner = NULL;
+    const char *name = getenv("AFS_SCAN");
+    for (size_t i = 0; name && i < sizeof(Scanners)/sizeof(Scanners[0]); i++) {
+    	if (strcmp(Scanners[i].Name, name) == 0 && scan_supported(Scanners[i])) {
+    	    scanner = &Scanners[i];
+	}
+    }
+    for (size_t i = 0; scanner == NULL; i++) {
+    	if (scan_supported(Scanners[i])) {
+    	    scanner = &Scanners[i];
+	}
+    }
+    return scanner;
+}
+
+// The implementation in use: the default, picked once on first use (the
+// static is initialized exactly once even with several threads scanning),
+// unless scan_select chose another
+static std::atomic<const Scanner *> &scan_chosen() {
+    static std::atomic<const Scanner *> Chosen(scan_default());
+    return Chosen;
+}
+
+static const Scanner *scan_current() {
+    return scan_chosen().load(std::memory_order_relaxed);
+}
+
+// Public interface ------------------------------------------------------------
+
+size_t scan_first_zero32(const uint32_t *values, size_t count) {
+    return scan_current()->FirstZero32(values, count);
+}
+
+size_t scan_first_nonzero32(const uint32_t *values, size_t count) {
+    return scan_current()->FirstNonzero32(values, count);
+}
+
+size_t scan_first_zero64(const uint64_t *values, size_t count) {
+    return scan_current()->FirstZero64(values, count);
+}
+
+size_t scan_nonzero32(const uint32_t *values, size_t count, uint32_t *positions) {
+    return scan_current()->Nonzero32(values, count, positions);
+}
+
+size_t count_nonzero32(const uint32_t *values, size_t count) {
+    return scan_current()->CountNonzero32(values, count);
+}
+
+size_t scan_valid(const uint32_t *words, size_t count, size_t stride, uint32_t *positions) {
+    return scan_current()->Valid(words, count, stride, positions);
+}
+
+const char *scan_implementation() {
+    return scan_current()->Name;
+}
+
+bool scan_select(const char *name) {
+    for (size_t i = 0; i < sizeof(Scanners)/sizeof(Scanners[0]); i++) {
+    	if (strcmp(Scanners[i].Name, name) == 0 && scan_supported(Scanners[i])) {
+    	    scan_chosen().store(&Scanners[i], std::memory_order_relaxed);
+    	    return true;
+	}
+    }
+    return false;
+}
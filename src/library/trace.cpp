@@ -0,0 +1,169 @@
+// trace.cpp: Operation tracing
+
+#include "afs/trace.h"
+
+#include <algorithm>
+#include <chrono>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+#include <stdio.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+std::atomic<bool> Trace::Enabled(false);
+
+namespace {
+
+struct Event {
+    const char *Name;
+    const char *Key;
+    uint64_t	Value;
+    uint64_t	Start;		    // Nanoseconds
+    uint64_t	Duration;	    // Nanoseconds
+    uint32_t	Thread;		    // Kernel thread id
+};
+
+// Only its owning thread writes to a ring; Head is published after each
+// event so a dump sees whole events. start() bumps Generation rather than
+// touching other threads' rings, and each owner empties its ring the next
+// time it records.
+std::atomic<uint64_t> Generation(0);
+
+struct Ring {
+    std::vector<Event>	  Events;
+    std::atomic<size_t>	  Head;
+    std::atomic<uint64_t> Generation;	// Generation Head counts from
+
+    Ring() : Events(Trace::RING_EVENTS), Head(0), Generation(0) {}
+
+    // Head, or 0 if the ring was filled before the last start
+    size_t recorded() const {
+    	if (Generation.load(std::memory_order_acquire) != ::Generation.load()) {
+    	    return 0;
+	}
+	return Head.load(std::memory_order_acquire);
+    }
+};
+
+// Rings outlive their threads, so spans from short lived I/O threads can
+// still be dumped; a new thread reuses a ring an old one left behind
+std::mutex Lock;		    // Guards the lists below
+std::vector<std::unique_ptr<Ring> > Rings;
+std::vector<Ring *> Free;
+uint64_t Epoch = 0;		    // Time of start, so traces begin at 0
+
+struct Owner {
+    Ring    *Owned = NULL;
+    uint32_t Thread = 0;
+
+    Ring *ring() {
+    	if (Owned == NULL) {
+    	    std::lock_guard<std::mutex> guard(Lock);
+    	    if (Free.empty()) {
+    	    	Rings.push_back(std::unique_ptr<Ring>(new Ring()));
+    	    	Owned = Rings.back().get();
+	    } else {
+	    	Owned = Free.back();
+	    	Free.pop_back();
+	    }
+	    Thread = syscall(SYS_gettid);
+	}
+	return Owned;
+    }
+
+    ~Owner() {
+    	if (Owned != NULL) {
+    	    std::lock_guard<std::mutex> guard(Lock);
+    	    Free.push_back(Owned);
+	}
+    }
+};
+
+thread_local Owner Current;
+
+}
+
+uint64_t Trace::now() {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count() | 1;
+}
+
+void Trace::record(const char *name, const char *key, uint64_t value, uint64_t start) {
+    Ring    *ring = Current.ring();
+    uint64_t generation = Generation.load();
+    if (ring->Generation.load(std::memory_order_relaxed) != generation) {
+    	ring->Head.store(0, std::memory_order_relaxed);
+    	ring->Generation.store(generation, std::memory_order_release);
+    }
+    size_t head = ring->Head.load(std::memory_order_relaxed);
+    Event &event = ring->Events[head % RING_EVENTS];
+
+    event.Name	   = name;
+    event.Key	   = key;
+    event.Value	   = value;
+    event.Start	   = start;
+    event.Duration = now() - start;
+    event.Thread   = Current.Thread;
+    ring->Head.store(head + 1, std::memory_order_release);
+}
+
+void Trace::start() {
+    std::lock_guard<std::mutex> guard(Lock);
+    Generation++;
+    Epoch = now();
+    Enabled = true;
+}
+
+void Trace::stop() {
+    Enabled = false;
+}
+
+ssize_t Trace::dump(const char *path) {
+    FILE *stream = fopen(path, "w");
+    if (stream == NULL) {
+    	return -1;
+    }
+
+    // Spans are recorded as they end; sorted by start, each one follows the
+    // span it is nested in
+    std::vector<Event> events;
+    {
+    	std::lock_guard<std::mutex> guard(Lock);
+    	for (size_t r = 0; r < Rings.size(); r++) {
+    	    size_t head = Rings[r]->recorded();
+    	    for (size_t e = head > RING_EVENTS ? head - RING_EVENTS : 0; e < head; e++) {
+    	    	events.push_back(Rings[r]->Events[e % RING_EVENTS]);
+	    }
+	}
+    }
+    std::stable_sort(events.begin(), events.end(), [](const Event &a, const Event &b) { return a.Start < b.Start; });
+
+    fprintf(stream, "{\"displayTimeUnit\": \"ns\", \"traceEvents\": [\n");
+    for (size_t e = 0; e < events.size(); e++) {
+    	const Event &event = events[e];
+    	uint64_t start = event.Start > Epoch ? event.Start - Epoch : 0;
+    	fprintf(stream, "{\"name\": \"%s\", \"cat\": \"afs\", \"ph\": \"X\", \"pid\": %d, \"tid\": %u, \"ts\": %lu.%03lu, \"dur\": %lu.%03lu",
+    		event.Name, getpid(), event.Thread, start / 1000, start % 1000, event.Duration / 1000, event.Duration % 1000);
+    	if (event.Key != NULL) {
+    	    fprintf(stream, ", \"args\": {\"%s\": %lu}", event.Key, event.Value);
+	}
+	fprintf(stream, "}%s\n", e + 1 < events.size() ? "," : "");
+    }
+    fprintf(stream, "]}\n");
+
+    if (fclose(stream) != 0) {
+    	return -1;
+    }
+    return events.size();
+}
+
+size_t Trace::dropped() {
+    std::lock_guard<std::mutex> guard(Lock);
+    size_t dropped = 0;
+    for (size_t r = 0; r < Rings.size(); r++) {
+    	size_t head = Rings[r]->recorded();
+    	dropped += head > RING_EVENTS ? head - RING_EVENTS : 0;
+    }
+    return dropped;
+}
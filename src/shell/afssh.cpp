@@ -2,15 +2,24 @@
 
 #include "afs/disk.h"
 #include "afs/fs.h"
+#include "afs/modeldisk.h"
+#include "afs/ramdisk.h"
+#include "afs/trace.h"
+#include "bulk.h"
 
+#include <chrono>
+#include <memory>
 #include <sstream>
 #include <string>
 #include <stdexcept>
+#include <thread>
+#include <vector>
 
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/types.h>
+#include <unistd.h>
 
 // Macros
 
@@ -27,6 +36,17 @@ void do_create(Disk &disk, FileSystem &fs, int args, char *arg1, char *arg2);
 void do_remove(Disk &disk, FileSystem &fs, int args, char *arg1, char *arg2);
 void do_stat(Disk &disk, FileSystem &fs, int args, char *arg1, char *arg2);
 void do_copyin(Disk &disk, FileSystem &fs, int args, char *arg1, char *arg2);
+void do_import(Disk &disk, FileSystem &fs, int args, char *arg1, char *arg2);
+void do_export(Disk &disk, FileSystem &fs, int args, char *arg1, char *arg2);
+void do_append(Disk &disk, FileSystem &fs, int args, char *arg1, char *arg2);
+void do_preallocate(Disk &disk, FileSystem &fs, int args, char *arg1, char *arg2);
+void do_sync(Disk &disk, FileSystem &fs, int args, char *arg1, char *arg2);
+void do_defrag(Disk &disk, FileSystem &fs, int args, char *arg1, char *arg2);
+void do_clone(Disk &disk, FileSystem &fs, int args, char *arg1, char *arg2);
+void do_snapshot(Disk &disk, FileSystem &fs, int args, char *arg1, char *arg2);
+void do_discard(Disk &disk, FileSystem &fs, int args, char *arg1, char *arg2);
+void do_trim(Disk &disk, FileSystem &fs, int args, char *arg1, char *arg2);
+void do_trace(Disk &disk, FileSystem &fs, int args, char *arg1, char *arg2);
 void do_help(Disk &disk, FileSystem &fs, int args, char *arg1, char *arg2);
 
 bool copyout(FileSystem &fs, size_t inumber, const char *path);
@@ -35,18 +55,58 @@ bool copyin(FileSystem &fs, const char *path, size_t inumber);
 // Main execution
 
 int main(int argc, char *argv[]) {
-    Disk	disk;
+    std::unique_ptr<Disk> disk;	// Declared first, so fs unmounts before it goes
     FileSystem	fs;
+    const char *backend = "file";
+    size_t	stripe_blocks = FileDisk::STRIPE_BLOCKS;
+    bool	direct = false;
+    int		c;
+
+    while ((c = getopt(argc, argv, "b:ds:")) != -1) {
+    	switch (c) {
+    	    case 'b': backend = optarg; break;
+    	    case 'd': direct = true; break;
+    	    case 's': stripe_blocks = strtoull(optarg, NULL, 10); break;
+    	    default:  optind = argc + 1; break;
+	}
+    }
 
-    if (argc != 3) {
-    	fprintf(stderr, "Usage: %s <diskfile> <nblocks>\n", argv[0]);
+    // Memory backends start empty unless given an image to copy
+    bool in_memory = streq(backend, "ram") || DiskModel::find(backend) != NULL;
+    if (!(argc - optind == 2 || (in_memory && argc - optind == 1)) ||
+	!(in_memory || streq(backend, "file"))) {
+    	fprintf(stderr, "Usage: %s [-b file|ram|hdd|ssd] [-d] [-s stripe-blocks] <diskfile[,diskfile...]> <nblocks>\n", argv[0]);
+    	fprintf(stderr, "       %s -b ram|hdd|ssd <nblocks>\n", argv[0]);
     	return EXIT_FAILURE;
     }
+    const char *image   = argc - optind == 2 ? argv[optind] : NULL;
+    size_t	nblocks = strtoull(argv[argc - 1], NULL, 10);
 
     try {
-    	disk.open(argv[1], atoi(argv[2]));
+    	if (in_memory) {
+    	    const DiskModel *model = DiskModel::find(backend);
+    	    RamDisk *ramdisk = model ? new ModelDisk(*model) : new RamDisk;
+    	    disk.reset(ramdisk);
+    	    if (image) {
+    	    	ramdisk->load(image, nblocks);
+	    } else {
+	    	ramdisk->open(nblocks);
+	    }
+	} else {
+	    // Several comma separated images make a striped disk
+	    std::vector<std::string> paths;
+	    std::stringstream path_list(image);
+	    std::string path;
+	    while (std::getline(path_list, path, ',')) {
+	    	paths.push_back(path);
+	    }
+
+	    FileDisk *filedisk = new FileDisk;
+	    disk.reset(filedisk);
+	    filedisk->open(paths, nblocks, stripe_blocks, direct);
+	}
     } catch (std::runtime_error &e) {
-    	fprintf(stderr, "Unable to open disk %s: %s\n", argv[1], e.what());
+    	fprintf(stderr, "Unable to open disk %s: %s\n", image ? image : backend, e.what());
     	return EXIT_FAILURE;
     }
 
@@ -66,25 +126,47 @@ int main(int argc, char *argv[]) {
 	}
 
 	if (streq(cmd, "debug")) {
-	    do_debug(disk, fs, args, arg1, arg2);
+	    do_debug(*disk, fs, args, arg1, arg2);
 	} else if (streq(cmd, "format")) {
-	    do_format(disk, fs, args, arg1, arg2);
+	    do_format(*disk, fs, args, arg1, arg2);
 	} else if (streq(cmd, "mount")) {
-	    do_mount(disk, fs, args, arg1, arg2);
+	    do_mount(*disk, fs, args, arg1, arg2);
 	} else if (streq(cmd, "cat")) {
-	    do_cat(disk, fs, args, arg1, arg2);
+	    do_cat(*disk, fs, args, arg1, arg2);
 	} else if (streq(cmd, "copyout")) {
-	    do_copyout(disk, fs, args, arg1, arg2);
+	    do_copyout(*disk, fs, args, arg1, arg2);
 	} else if (streq(cmd, "create")) {
-	    do_create(disk, fs, args, arg1, arg2);
+	    do_create(*disk, fs, args, arg1, arg2);
 	} else if (streq(cmd, "remove")) {
-	    do_remove(disk, fs, args, arg1, arg2);
+	    do_remove(*disk, fs, args, arg1, arg2);
 	} else if (streq(cmd, "stat")) {
-	    do_stat(disk, fs, args, arg1, arg2);
+	    do_stat(*disk, fs, args, arg1, arg2);
 	} else if (streq(cmd, "copyin")) {
-	    do_copyin(disk, fs, args, arg1, arg2);
+	    do_copyin(*disk, fs, args, arg1, arg2);
+	} else if (streq(cmd, "import")) {
+	    do_import(*disk, fs, args, arg1, arg2);
+	} else if (streq(cmd, "export")) {
+	    do_export(*disk, fs, args, arg1, arg2);
+	} else if (streq(cmd, "append")) {
+	    do_append(*disk, fs, args, arg1, arg2);
+	} else if (streq(cmd, "preallocate")) {
+	    do_preallocate(*disk, fs, args, arg1, arg2);
+	} else if (streq(cmd, "sync")) {
+	    do_sync(*disk, fs, args, arg1, arg2);
+	} else if (streq(cmd, "defrag")) {
+	    do_defrag(*disk, fs, args, arg1, arg2);
+	} else if (streq(cmd, "clone")) {
+	    do_clone(*disk, fs, args, arg1, arg2);
+	} else if (streq(cmd, "snapshot")) {
+	    do_snapshot(*disk, fs, args, arg1, arg2);
+	} else if (streq(cmd, "discard")) {
+	    do_discard(*disk, fs, args, arg1, arg2);
+	} else if (streq(cmd, "trim")) {
+	    do_trim(*disk, fs, args, arg1, arg2);
+	} else if (streq(cmd, "trace")) {
+	    do_trace(*disk, fs, args, arg1, arg2);
 	} else if (streq(cmd, "help")) {
-	    do_help(disk, fs, args, arg1, arg2);
+	    do_help(*disk, fs, args, arg1, arg2);
 	} else if (streq(cmd, "exit") || streq(cmd, "quit")) {
 	    break;
 	} else {
@@ -93,6 +175,9 @@ int main(int argc, char *argv[]) {
 	}
     }
 
+    if (fs.checksum_errors() > 0) {
+    	printf("%lu checksum errors\n", fs.checksum_errors());
+    }
     return EXIT_SUCCESS;
 }
 
@@ -108,12 +193,14 @@ void do_debug(Disk &disk, FileSystem &fs, int args, char *arg1, char *arg2) {
 }
 
 void do_format(Disk &disk, FileSystem &fs, int args, char *arg1, char *arg2) {
-    if (args != 1) {
-    	printf("Usage: format\n");
+    if (args > 3 || (args > 1 && !streq(arg1, "v1") && !streq(arg1, "v2"))) {
+    	printf("Usage: format [v1|v2] [bytes-per-inode]\n");
     	return;
     }
 
-    if (fs.format(&disk)) {
+    uint32_t version         = args > 1 && streq(arg1, "v2") ? 2 : 1;
+    size_t   bytes_per_inode = args == 3 ? strtoull(arg2, NULL, 10) : 0;
+    if (fs.format(&disk, version, bytes_per_inode)) {
     	printf("disk formatted.\n");
     } else {
     	printf("format failed!\n");
@@ -209,9 +296,234 @@ void do_copyin(Disk &disk, FileSystem &fs, int args, char *arg1, char *arg2) {
     }
 }
 
+void do_import(Disk &disk, FileSystem &fs, int args, char *arg1, char *arg2) {
+    if (args != 2) {
+    	printf("Usage: import <hostdir>\n");
+    	return;
+    }
+
+    if (!import_tree(fs, arg1)) {
+    	printf("import failed!\n");
+    }
+}
+
+void do_export(Disk &disk, FileSystem &fs, int args, char *arg1, char *arg2) {
+    if (args != 2) {
+    	printf("Usage: export <dir>\n");
+    	return;
+    }
+
+    if (!export_tree(fs, arg1)) {
+    	printf("export failed!\n");
+    }
+}
+
+void do_append(Disk &disk, FileSystem &fs, int args, char *arg1, char *arg2) {
+    if (args != 3) {
+    	printf("Usage: append <file> <inode>\n");
+    	return;
+    }
+
+    FILE *stream = fopen(arg1, "r");
+    if (stream == nullptr) {
+    	fprintf(stderr, "Unable to open %s: %s\n", arg1, strerror(errno));
+    	printf("append failed!\n");
+    	return;
+    }
+
+    // One append per line, as a log writer would issue them
+    char   *line     = NULL;
+    size_t  capacity = 0;
+    size_t  appends  = 0, offset = 0;
+    ssize_t length;
+    while ((length = getline(&line, &capacity, stream)) > 0) {
+    	ssize_t actual = fs.append(atoi(arg2), line, length);
+    	if (actual < 0) {
+    	    break;
+	}
+	offset += actual;
+	appends++;
+	if (actual != length) {
+	    break;
+	}
+    }
+    free(line);
+    fclose(stream);
+
+    if (appends == 0 && length > 0) {
+    	printf("append failed!\n");
+    	return;
+    }
+    printf("%lu bytes appended in %lu appends\n", offset, appends);
+}
+
+void do_preallocate(Disk &disk, FileSystem &fs, int args, char *arg1, char *arg2) {
+    if (args != 3) {
+    	printf("Usage: preallocate <inode> <bytes>\n");
+    	return;
+    }
+
+    ssize_t inumber  = atoi(arg1);
+    ssize_t reserved = fs.preallocate(inumber, strtoul(arg2, NULL, 10));
+    if (reserved >= 0) {
+    	printf("preallocated %ld blocks for inode %ld.\n", reserved, inumber);
+    } else {
+    	printf("preallocate failed!\n");
+    }
+}
+
+void do_sync(Disk &disk, FileSystem &fs, int args, char *arg1, char *arg2) {
+    if (args != 2) {
+    	printf("Usage: sync <inode>\n");
+    	return;
+    }
+
+    ssize_t inumber = atoi(arg1);
+    if (fs.sync(inumber)) {
+    	printf("synced inode %ld.\n", inumber);
+    } else {
+    	printf("sync failed!\n");
+    }
+}
+
+void defrag(FileSystem &fs, size_t inumber, size_t rate) {
+    size_t extents = fs.fragmentation(inumber);
+    ssize_t moved  = 0;
+    size_t shared  = 0;
+
+    if (rate == 0) {
+    	moved = fs.defrag(inumber, -1, &shared);
+    } else {
+    	// Move a batch at a time and sleep between them, so the file system
+    	// is never held while waiting
+    	std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    	ssize_t batch;
+    	while ((batch = fs.defrag(inumber, FileSystem::DEFRAG_BATCH, &shared)) > 0) {
+    	    moved += batch;
+    	    std::this_thread::sleep_until(start + std::chrono::microseconds(moved * 1000000 / rate));
+	}
+	if (batch < 0) {
+	    moved = -1;
+	}
+    }
+
+    if (moved < 0) {
+    	printf("defrag of inode %lu failed!\n", inumber);
+    	return;
+    }
+    if (shared > 0) {
+    	printf("inode %lu: %lu extents, not moved: %lu blocks are shared with a clone.\n", inumber, extents, shared);
+    	return;
+    }
+    printf("inode %lu: %lu extents, %ld blocks moved, now %lu extents.\n", inumber, extents, moved, fs.fragmentation(inumber));
+}
+
+void do_defrag(Disk &disk, FileSystem &fs, int args, char *arg1, char *arg2) {
+    if (args > 3) {
+    	printf("Usage: defrag [inode|all] [blocks/second]\n");
+    	return;
+    }
+
+    size_t rate = args == 3 ? atoi(arg2) : 0;
+
+    if (args == 1 || streq(arg1, "all")) {
+    	for (size_t inumber = 0; inumber < fs.inodes(); inumber++) {
+    	    if ((ssize_t)fs.fragmentation(inumber) > 1) {
+    	    	defrag(fs, inumber, rate);
+	    }
+	}
+    } else {
+    	defrag(fs, atoi(arg1), rate);
+    }
+}
+
+void do_clone(Disk &disk, FileSystem &fs, int args, char *arg1, char *arg2) {
+    if (args != 2) {
+    	printf("Usage: clone <inode>\n");
+    	return;
+    }
+
+    ssize_t inumber = atoi(arg1);
+    ssize_t clone   = fs.clone(inumber);
+    if (clone >= 0) {
+    	printf("cloned inode %ld to inode %ld.\n", inumber, clone);
+    } else {
+    	printf("clone failed!\n");
+    }
+}
+
+void do_snapshot(Disk &disk, FileSystem &fs, int args, char *arg1, char *arg2) {
+    if (args != 1) {
+    	printf("Usage: snapshot\n");
+    	return;
+    }
+
+    // Find every file first, so the clones themselves are not cloned
+    std::vector<size_t> inodes;
+    for (size_t inumber = 0; inumber < fs.inodes(); inumber++) {
+    	if ((ssize_t)fs.stat(inumber) >= 0) {
+    	    inodes.push_back(inumber);
+	}
+    }
+
+    for (size_t i = 0; i < inodes.size(); i++) {
+    	ssize_t clone = fs.clone(inodes[i]);
+    	if (clone < 0) {
+    	    printf("snapshot failed at inode %lu!\n", inodes[i]);
+    	    return;
+	}
+	printf("cloned inode %lu to inode %ld.\n", inodes[i], clone);
+    }
+    printf("snapshot of %lu inodes.\n", inodes.size());
+}
+
+void do_discard(Disk &disk, FileSystem &fs, int args, char *arg1, char *arg2) {
+    if (args != 2 || (!streq(arg1, "on") && !streq(arg1, "off"))) {
+    	printf("Usage: discard <on|off>\n");
+    	return;
+    }
+
+    fs.set_discard(streq(arg1, "on"));
+    printf("discard %s.\n", arg1);
+}
+
+void do_trim(Disk &disk, FileSystem &fs, int args, char *arg1, char *arg2) {
+    if (args != 1) {
+    	printf("Usage: trim\n");
+    	return;
+    }
+
+    ssize_t trimmed = fs.trim();
+    if (trimmed >= 0) {
+    	printf("trimmed %ld blocks.\n", trimmed);
+    } else {
+    	printf("trim failed!\n");
+    }
+}
+
+void do_trace(Disk &disk, FileSystem &fs, int args, char *arg1, char *arg2) {
+    if (args == 2 && streq(arg1, "start")) {
+    	Trace::start();
+    	printf("tracing started.\n");
+    } else if (args == 2 && streq(arg1, "stop")) {
+    	Trace::stop();
+    	printf("tracing stopped.\n");
+    } else if (args == 3 && streq(arg1, "dump")) {
+    	ssize_t events = Trace::dump(arg2);
+    	if (events < 0) {
+    	    fprintf(stderr, "Unable to open %s: %s\n", arg2, strerror(errno));
+    	    printf("trace dump failed!\n");
+    	    return;
+	}
+	printf("%ld trace events written to %s (%lu dropped).\n", events, arg2, Trace::dropped());
+    } else {
+    	printf("Usage: trace <start|stop|dump> [file]\n");
+    }
+}
+
 void do_help(Disk &disk, FileSystem &fs, int args, char *arg1, char *arg2) {
     printf("Commands are:\n");
-    printf("    format\n");
+    printf("    format  [v1|v2] [bytes-per-inode]\n");
     printf("    mount\n");
     printf("    debug\n");
     printf("    create\n");
@@ -220,6 +532,17 @@ void do_help(Disk &disk, FileSystem &fs, int args, char *arg1, char *arg2) {
     printf("    stat    <inode>\n");
     printf("    copyin  <file> <inode>\n");
     printf("    copyout <inode> <file>\n");
+    printf("    import  <hostdir>\n");
+    printf("    export  <dir>\n");
+    printf("    append  <file> <inode>\n");
+    printf("    preallocate <inode> <bytes>\n");
+    printf("    sync    <inode>\n");
+    printf("    defrag  [inode|all] [blocks/second]\n");
+    printf("    clone   <inode>\n");
+    printf("    snapshot\n");
+    printf("    discard <on|off>\n");
+    printf("    trim\n");
+    printf("    trace   <start|stop|dump> [file]\n");
     printf("    help\n");
     printf("    quit\n");
     printf("    exit\n");
@@ -234,14 +557,16 @@ bool copyout(FileSystem &fs, size_t inumber, const char *path) {
 
     char buffer[4*BUFSIZ] = {0};
     size_t offset = 0;
-    while (true) {
-    	ssize_t result = fs.read(inumber, buffer, sizeof(buffer), offset);
+    int handle = fs.open(inumber);
+    while (handle >= 0) {
+    	ssize_t result = fs.read(handle, buffer, sizeof(buffer));
     	if (result <= 0) {
     	    break;
 	}
 	fwrite(buffer, 1, result, stream);
 	offset += result;
     }
+    fs.close(handle);
 
     printf("%lu bytes copied\n", offset);
     fclose(stream);
@@ -258,13 +583,14 @@ bool copyin(FileSystem &fs, const char *path, size_t inumber) {
     char buffer[4*BUFSIZ] = {0};
     size_t offset = 0;
     ssize_t result;
-    while (true) {
+    int handle = fs.open(inumber);
+    while (handle >= 0) {
     	result = fread(buffer, 1, sizeof(buffer), stream);
     	if (result <= 0) {
     	    break;
 	}
 
-	ssize_t actual = fs.write(inumber, buffer, result, offset);
+	ssize_t actual = fs.write(handle, buffer, result);
 	if (actual < 0) {
 	    fprintf(stderr, "fs.write returned invalid result %ld\n", actual);
 	    break;
@@ -276,6 +602,7 @@ bool copyin(FileSystem &fs, const char *path, size_t inumber) {
 	    break;
 	}
     }
+    fs.close(handle);
 
     printf("%lu bytes copied\n", offset);
     fclose(stream);
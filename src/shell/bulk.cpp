@@ -0,0 +1,434 @@
+// bulk.cpp: Pipelined import and export of host directory trees
+
+#include "afs/pool.h"
+#include "bulk.h"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <new>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+// Buffers in flight between the two stages, and their size: enough for
+// host I/O to run well ahead of the file system without much memory
+const size_t BULK_BUFFERS     = 8;
+const size_t BULK_BUFFER_SIZE = 1 << 20;
+
+// Inodes taken from the table at a time on import
+const size_t BULK_INODE_BATCH = 256;
+
+// Part of a file on its way from one stage to the other
+struct Chunk {
+    size_t  File;		    // Index of the file (-1 marks the end of the stream)
+    char   *Data;		    // Buffer, owned by the pool of BULK_BUFFERS
+    size_t  Length;		    // Bytes of Data in use
+    bool    Last;		    // Whether this is the file's last chunk
+    bool    Failed;		    // Whether the producer could not read the file
+};
+
+// Bounded blocking queue: the free list holds every buffer at the start, so
+// a stage that gets too far ahead waits for the other to hand one back
+class ChunkQueue {
+private:
+    std::mutex		    Lock;
+    std::condition_variable Ready;
+    std::deque<Chunk>	    Chunks;
+
+public:
+    void push(const Chunk &chunk) {
+    	std::lock_guard<std::mutex> guard(Lock);
+    	Chunks.push_back(chunk);
+    	Ready.notify_one();
+    }
+
+    Chunk pop() {
+    	std::unique_lock<std::mutex> guard(Lock);
+    	Ready.wait(guard, [this] { return !Chunks.empty(); });
+    	Chunk chunk = Chunks.front();
+    	Chunks.pop_front();
+    	return chunk;
+    }
+};
+
+// Aligned buffers, so O_DIRECT images take them without a copy
+class ChunkBuffers {
+private:
+    std::vector<char *> Buffers;
+
+public:
+    ChunkBuffers(ChunkQueue &free) {
+    	for (size_t b = 0; b < BULK_BUFFERS; b++) {
+    	    void *memory;
+    	    if (posix_memalign(&memory, BlockPool::ALIGNMENT, BULK_BUFFER_SIZE) != 0) {
+    	    	throw std::bad_alloc();
+	    }
+	    Buffers.push_back((char *)memory);
+	    Chunk chunk = {0, (char *)memory, 0, false, false};
+	    free.push(chunk);
+	}
+    }
+
+    ~ChunkBuffers() {
+    	for (size_t b = 0; b < Buffers.size(); b++) {
+    	    free(Buffers[b]);
+	}
+    }
+};
+
+// The other stage's thread. The stage that made it joins it once the
+// stream has ended; if that stage throws instead, the destructor unblocks
+// the thread first, as a joinable std::thread must not be destroyed.
+class StageThread {
+private:
+    std::thread		  Thread;
+    std::function<void()> Unblock;
+
+public:
+    StageThread(std::thread &&thread, std::function<void()> unblock)
+    	: Thread(std::move(thread)), Unblock(unblock) {}
+
+    void join() {
+    	Thread.join();
+    }
+
+    ~StageThread() {
+    	if (Thread.joinable()) {
+    	    Unblock();
+    	    Thread.join();
+	}
+    }
+};
+
+// Progress -------------------------------------------------------------------
+
+class Progress {
+private:
+    const char *Verb;
+    size_t	Files;		    // Files to transfer
+    size_t	Done = 0;	    // Files transferred
+    size_t	Skipped = 0;	    // Files that failed
+    size_t	Bytes = 0;	    // Bytes transferred
+    std::chrono::steady_clock::time_point Start, Reported;
+
+    double seconds() const {
+    	return std::chrono::duration<double>(std::chrono::steady_clock::now() - Start).count();
+    }
+
+public:
+    Progress(const char *verb, size_t files)
+    	: Verb(verb), Files(files), Start(std::chrono::steady_clock::now()), Reported(Start) {}
+
+    // Count a finished file, and report at most once a second
+    void file(size_t bytes) {
+    	Done++;
+    	Bytes += bytes;
+    	std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+    	if (now - Reported >= std::chrono::seconds(1)) {
+    	    Reported = now;
+    	    double elapsed = seconds();
+    	    printf("    %lu of %lu files, %.1f MiB, %.1f MiB/s\n", Done, Files, Bytes / 1048576.0, Bytes / 1048576.0 / elapsed);
+    	    fflush(stdout);
+	}
+    }
+
+    // Count a file that failed, and was reported as it did
+    void skip() {
+    	Skipped++;
+    }
+
+    // Report the totals; returns whether no file was skipped
+    bool finish() {
+    	double elapsed = seconds();
+    	printf("%s %lu files (%lu bytes) in %.3f seconds, %.1f MiB/s.\n",
+    	       Verb, Done, Bytes, elapsed, elapsed > 0 ? Bytes / 1048576.0 / elapsed : 0.0);
+    	if (Skipped > 0) {
+    	    printf("%lu files skipped.\n", Skipped);
+	}
+	return Skipped == 0;
+    }
+};
+
+// Import ---------------------------------------------------------------------
+
+// Every regular file under dir, in a stable (sorted) order
+static bool list_tree(const std::string &dir, std::vector<std::string> &paths) {
+    DIR *stream = opendir(dir.c_str());
+    if (stream == NULL) {
+    	fprintf(stderr, "Unable to open %s: %s\n", dir.c_str(), strerror(errno));
+    	return false;
+    }
+
+    std::vector<std::string> names;
+    struct dirent *entry;
+    while ((entry = readdir(stream)) != NULL) {
+    	if (strcmp(entry->d_name, ".") != 0 && strcmp(entry->d_name, "..") != 0) {
+    	    names.push_back(entry->d_name);
+	}
+    }
+    closedir(stream);
+    std::sort(names.begin(), names.end());
+
+    for (size_t n = 0; n < names.size(); n++) {
+    	std::string path = dir + "/" + names[n];
+    	struct stat s;
+    	if (lstat(path.c_str(), &s) < 0) {
+    	    continue;
+	}
+	if (S_ISDIR(s.st_mode)) {
+	    if (!list_tree(path, paths)) {
+	    	return false;
+	    }
+	} else if (S_ISREG(s.st_mode)) {
+	    paths.push_back(path);
+	}
+    }
+    return true;
+}
+
+// Reader stage: host files into chunks, one file after another
+static void read_files(const std::vector<std::string> &paths, ChunkQueue &free, ChunkQueue &full, std::atomic<bool> &cancel) {
+    for (size_t f = 0; f < paths.size() && !cancel; f++) {
+    	int fd = open(paths[f].c_str(), O_RDONLY);
+    	Chunk chunk;
+    	do {
+    	    chunk = free.pop();
+    	    chunk.File = f;
+    	    chunk.Length = 0;
+    	    chunk.Failed = fd < 0;
+    	    while (fd >= 0 && chunk.Length < BULK_BUFFER_SIZE) {
+    	    	ssize_t result = read(fd, chunk.Data + chunk.Length, BULK_BUFFER_SIZE - chunk.Length);
+    	    	if (result <= 0) {
+    	    	    chunk.Failed = result < 0;
+    	    	    break;
+		}
+		chunk.Length += result;
+	    }
+	    chunk.Last = chunk.Failed || chunk.Length < BULK_BUFFER_SIZE;
+	    full.push(chunk);
+	} while (!chunk.Last && !cancel);
+	if (fd >= 0) {
+	    close(fd);
+	}
+    }
+
+    Chunk end = free.pop();
+    end.File = -1;
+    full.push(end);
+}
+
+bool import_tree(FileSystem &fs, const char *hostdir) {
+    std::vector<std::string> paths;
+    if (!list_tree(hostdir, paths)) {
+    	return false;
+    }
+
+    ChunkQueue free, full;
+    ChunkBuffers buffers(free);
+    std::atomic<bool> cancel(false);
+    StageThread reader(std::thread(read_files, std::cref(paths), std::ref(free), std::ref(full), std::ref(cancel)), [&] {
+    	cancel = true;
+    	for (Chunk chunk = full.pop(); chunk.File != (size_t)-1; chunk = full.pop()) {
+    	    free.push(chunk);
+	}
+    });
+
+    // Writer stage: chunks into inodes, taken from the table in batches. A
+    // file that fails loses its inode and the rest of its chunks; running
+    // out of inodes stops the import.
+    Progress progress("imported", paths.size());
+    std::vector<size_t> inumbers;
+    size_t next_inode = 0;
+    size_t current = -1, inumber = 0, written = 0;
+    int    handle = -1;		    // Open while the current file is written
+    while (true) {
+    	Chunk chunk = full.pop();
+    	if (chunk.File == (size_t)-1) {
+    	    free.push(chunk);
+    	    break;
+	}
+
+	if (chunk.File != current && !cancel) {
+	    current = chunk.File;
+	    written = 0;
+	    if (next_inode == inumbers.size()) {
+	    	inumbers.clear();
+	    	next_inode = 0;
+	    	fs.create(std::min(BULK_INODE_BATCH, paths.size() - current), inumbers);
+	    }
+	    if (next_inode == inumbers.size()) {
+	    	fprintf(stderr, "No free inodes for %s\n", paths[current].c_str());
+	    	cancel = true;
+	    } else {
+	    	inumber = inumbers[next_inode++];
+	    	handle  = fs.open(inumber);
+	    	if (handle < 0) {
+	    	    fprintf(stderr, "Unable to open inode %lu for %s\n", inumber, paths[current].c_str());
+	    	    fs.remove(inumber);
+	    	    progress.skip();
+		}
+	    }
+	}
+
+	bool failed = false;
+	if (handle >= 0 && chunk.Failed) {
+	    fprintf(stderr, "Unable to read %s\n", paths[current].c_str());
+	    failed = true;
+	}
+	if (handle >= 0 && !failed && chunk.Length > 0) {
+	    ssize_t actual = fs.write(handle, chunk.Data, chunk.Length);
+	    if (actual < 0 || (size_t)actual != chunk.Length) {
+	    	fprintf(stderr, "fs.write only wrote %ld bytes of %s\n", written + std::max(actual, (ssize_t)0), paths[current].c_str());
+	    	failed = true;
+	    } else {
+	    	written += actual;
+	    }
+	}
+	if (handle >= 0 && (chunk.Last || failed)) {
+	    fs.close(handle);
+	    handle = -1;
+	    if (failed) {
+	    	fs.remove(inumber);
+	    	progress.skip();
+	    } else {
+	    	progress.file(written);
+	    }
+	}
+	free.push(chunk);
+    }
+    reader.join();
+
+    // Inodes taken but left unused go back to the table
+    for (size_t i = next_inode; i < inumbers.size(); i++) {
+    	fs.remove(inumbers[i]);
+    }
+
+    bool success = progress.finish();
+    return success && !cancel;
+}
+
+// Export ---------------------------------------------------------------------
+
+// Writer stage: chunks into host files named after their inodes. A file
+// that fails is removed and the rest of its chunks dropped; the stage owns
+// progress, as only it knows whether each file made it.
+static void write_files(const std::string &dir, const std::vector<size_t> &inodes, ChunkQueue &free, ChunkQueue &full, Progress &progress) {
+    std::string path;
+    size_t current = -1, written = 0;
+    int    fd = -1;			    // Open while the current file is written
+    while (true) {
+    	Chunk chunk = full.pop();
+    	if (chunk.File == (size_t)-1) {
+    	    free.push(chunk);
+    	    break;
+	}
+
+	if (chunk.File != current) {
+	    current = chunk.File;
+	    written = 0;
+	    path = dir + "/" + std::to_string(inodes[current]);
+	    fd = open(path.c_str(), O_WRONLY|O_CREAT|O_TRUNC, 0644);
+	    if (fd < 0) {
+	    	fprintf(stderr, "Unable to open %s: %s\n", path.c_str(), strerror(errno));
+	    	progress.skip();
+	    }
+	}
+
+	bool failed = chunk.Failed;
+	for (size_t offset = 0; fd >= 0 && !failed && offset < chunk.Length; ) {
+	    ssize_t result = write(fd, chunk.Data + offset, chunk.Length - offset);
+	    if (result < 0) {
+	    	fprintf(stderr, "Unable to write inode %lu: %s\n", inodes[current], strerror(errno));
+	    	failed = true;
+	    	break;
+	    }
+	    offset += result;
+	}
+	written += chunk.Length;
+	if (fd >= 0 && (chunk.Last || failed)) {
+	    close(fd);
+	    fd = -1;
+	    if (failed) {
+	    	unlink(path.c_str());
+	    	progress.skip();
+	    } else {
+	    	progress.file(written);
+	    }
+	}
+	free.push(chunk);
+    }
+}
+
+bool export_tree(FileSystem &fs, const char *dir) {
+    if (mkdir(dir, 0755) < 0 && errno != EEXIST) {
+    	fprintf(stderr, "Unable to create %s: %s\n", dir, strerror(errno));
+    	return false;
+    }
+
+    std::vector<size_t> inodes;
+    for (size_t inumber = 0; inumber < fs.inodes(); inumber++) {
+    	if ((ssize_t)fs.stat(inumber) >= 0) {
+    	    inodes.push_back(inumber);
+	}
+    }
+
+    // The writer ends when it sees the end of the stream, which the
+    // destructor sends if the reader stage throws before it does
+    ChunkQueue free, full;
+    ChunkBuffers buffers(free);
+    Progress progress("exported", inodes.size());
+    std::function<void()> end_stream = [&] {
+    	Chunk end = free.pop();
+    	end.File = -1;
+    	full.push(end);
+    };
+    StageThread writer(std::thread(write_files, std::string(dir), std::cref(inodes), std::ref(free), std::ref(full), std::ref(progress)), end_stream);
+
+    // Reader stage: inodes into chunks, on this thread as the file system
+    // is not shared between threads
+    for (size_t f = 0; f < inodes.size(); f++) {
+    	int   handle = fs.open(inodes[f]);
+    	Chunk chunk;
+    	do {
+    	    chunk = free.pop();
+    	    chunk.File = f;
+    	    chunk.Length = 0;
+    	    chunk.Failed = handle < 0;
+    	    while (handle >= 0 && chunk.Length < BULK_BUFFER_SIZE) {
+    	    	ssize_t result = fs.read(handle, chunk.Data + chunk.Length, BULK_BUFFER_SIZE - chunk.Length);
+    	    	if (result <= 0) {
+    	    	    chunk.Failed = result < 0;
+    	    	    break;
+		}
+		chunk.Length += result;
+	    }
+	    chunk.Last = chunk.Failed || chunk.Length < BULK_BUFFER_SIZE;
+	    full.push(chunk);
+	} while (!chunk.Last);
+	if (handle >= 0) {
+	    fs.close(handle);
+	}
+	if (chunk.Failed) {
+	    fprintf(stderr, "Unable to read inode %lu\n", inodes[f]);
+	}
+    }
+
+    end_stream();
+    writer.join();
+
+    return progress.finish();
+}
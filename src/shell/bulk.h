@@ -0,0 +1,15 @@
+// bulk.h: Pipelined import and export of host directory trees
+
+#pragma once
+
+#include "afs/fs.h"
+
+// Copy every regular file under hostdir into a new inode, in sorted path
+// order. A file that cannot be read or written is reported and skipped;
+// returns false if any was, or if the inodes ran out.
+bool import_tree(FileSystem &fs, const char *hostdir);
+
+// Copy every valid inode into dir, named by its inode number. An inode
+// that cannot be read or written is reported and skipped; returns false
+// if any was.
+bool export_tree(FileSystem &fs, const char *dir);
@@ -0,0 +1,153 @@
+#!/bin/bash
+
+SCRATCH=$(mktemp -d)
+trap "rm -fr $SCRATCH" INT QUIT TERM EXIT
+
+# Build an image with three small files
+
+seq 1 500 > $SCRATCH/small.txt
+cat <<EOF2 | ./bin/afssh $SCRATCH/image.64 64 > /dev/null 2>&1
+format
+mount
+create
+copyin $SCRATCH/small.txt 0
+create
+copyin $SCRATCH/small.txt 1
+create
+copyin $SCRATCH/small.txt 2
+EOF2
+
+echo -n "Testing afsck on clean $SCRATCH/image.64 ... "
+if ./bin/afsck -j 4 $SCRATCH/image.64 > $SCRATCH/test.log && grep -q '^0 errors' $SCRATCH/test.log; then
+    echo "Success"
+else
+    echo "Failure"
+    cat $SCRATCH/test.log
+fi
+
+# Point inode 1 at inode 0's first data block (block 8) and grow inode 2,
+# clearing the inode block's checksum (in block 7) so only the pointers
+# are wrong
+
+printf '\x08\x00\x00\x00' | dd of=$SCRATCH/image.64 bs=1 seek=$((4096 + 32 + 8)) conv=notrunc 2> /dev/null
+printf '\x50\xc3\x00\x00' | dd of=$SCRATCH/image.64 bs=1 seek=$((4096 + 64 + 4)) conv=notrunc 2> /dev/null
+printf '\x00\x00\x00\x00' | dd of=$SCRATCH/image.64 bs=1 seek=$((7*4096 + 4)) conv=notrunc 2> /dev/null
+
+echo -n "Testing afsck -r on corrupt $SCRATCH/image.64 ... "
+./bin/afsck -r -j 4 $SCRATCH/image.64 > $SCRATCH/test.log
+status=$?
+if [ $status = 1 ] &&
+   grep -q 'inode 1: block 8 is also owned by inode 0' $SCRATCH/test.log &&
+   grep -q 'inode 2: size 50000 bytes exceeds 1 allocated blocks' $SCRATCH/test.log &&
+   ./bin/afsck $SCRATCH/image.64 > /dev/null; then
+    echo "Success"
+else
+    echo "Failure"
+    cat $SCRATCH/test.log
+fi
+
+# Version 2 keeps reference counts on disk: give free block 10 a count of 5
+
+cat <<EOF2 | ./bin/afssh $SCRATCH/image.v2 64 > /dev/null 2>&1
+format v2
+mount
+create
+copyin $SCRATCH/small.txt 0
+EOF2
+printf '\x05\x00\x00\x00' | dd of=$SCRATCH/image.v2 bs=1 seek=$((3*4096 + 10*4)) conv=notrunc 2> /dev/null
+
+echo -n "Testing afsck -r on corrupt reference counts in $SCRATCH/image.v2 ... "
+./bin/afsck -r $SCRATCH/image.v2 > $SCRATCH/test.log
+status=$?
+if [ $status = 1 ] &&
+   grep -q 'block 10: reference count 5 should be 0' $SCRATCH/test.log &&
+   ./bin/afsck $SCRATCH/image.v2 > /dev/null; then
+    echo "Success"
+else
+    echo "Failure"
+    cat $SCRATCH/test.log
+fi
+
+# A block shared by two version 2 files is only a clone if its reference
+# count says so: point inode 1 at inode 0's block 4 without counting it
+# (and clear the inode block's checksum, in block 2)
+
+cat <<EOF2 | ./bin/afssh $SCRATCH/image.v2 64 > /dev/null 2>&1
+format v2
+mount
+create
+copyin $SCRATCH/small.txt 0
+create
+copyin $SCRATCH/small.txt 1
+EOF2
+printf '\x04' | dd of=$SCRATCH/image.v2 bs=1 seek=$((4096 + 64 + 16)) conv=notrunc 2> /dev/null
+printf '\x00\x00\x00\x00' | dd of=$SCRATCH/image.v2 bs=1 seek=$((2*4096 + 4)) conv=notrunc 2> /dev/null
+
+echo -n "Testing afsck -r on cross-linked $SCRATCH/image.v2 ... "
+./bin/afsck -r $SCRATCH/image.v2 > $SCRATCH/test.log
+status=$?
+if [ $status = 1 ] &&
+   grep -q 'inode 1: block 4 is also owned by inode 0' $SCRATCH/test.log &&
+   ! grep -q 'block 4: reference count' $SCRATCH/test.log &&
+   ./bin/afsck $SCRATCH/image.v2 > /dev/null; then
+    echo "Success"
+else
+    echo "Failure"
+    cat $SCRATCH/test.log
+fi
+
+# Repair never rewrites a checksum over corrupt contents: an inode block
+# that fails its checksum stays reported, and a pointer block that fails
+# its checksum is cut off the file it belongs to
+
+seq 1 20000 > $SCRATCH/large.txt
+cat <<EOF2 | ./bin/afssh $SCRATCH/image.64 64 > $SCRATCH/test.log 2>&1
+format
+mount
+create
+copyin $SCRATCH/small.txt 0
+create
+copyin $SCRATCH/large.txt 1
+debug
+EOF2
+indirect=$(awk '/indirect block:/ {print $3}' $SCRATCH/test.log)
+cp $SCRATCH/image.64 $SCRATCH/inodes.64
+printf '\xff' | dd of=$SCRATCH/image.64 bs=1 seek=$((indirect*4096 + 4000)) conv=notrunc 2> /dev/null
+printf '\xff' | dd of=$SCRATCH/inodes.64 bs=1 seek=$((4096 + 4)) conv=notrunc 2> /dev/null
+
+echo -n "Testing afsck -r on checksum mismatches in $SCRATCH/image.64 ... "
+./bin/afsck -r $SCRATCH/image.64 > $SCRATCH/test.log
+status=$?
+./bin/afsck -r $SCRATCH/inodes.64 > $SCRATCH/inodes.log
+inodes_status=$?
+printf "mount\nstat 1\n" | ./bin/afssh $SCRATCH/image.64 64 >> $SCRATCH/test.log 2>&1
+if [ $status = 1 ] && [ $inodes_status = 4 ] &&
+   grep -q "^block $indirect: checksum mismatch" $SCRATCH/test.log &&
+   grep -q '^inode 1 has size 20480 bytes' $SCRATCH/test.log &&
+   ./bin/afsck $SCRATCH/image.64 > /dev/null &&
+   grep -q '^block 1: checksum mismatch' $SCRATCH/inodes.log &&
+   grep -q '^1 errors, 0 repaired' $SCRATCH/inodes.log &&
+   ./bin/afsck $SCRATCH/inodes.64 | grep -q '^block 1: checksum mismatch'; then
+    echo "Success"
+else
+    echo "Failure"
+    cat $SCRATCH/test.log $SCRATCH/inodes.log
+fi
+
+# Without -r the image is opened read-only, and one that is not a whole
+# number of blocks is refused rather than resized
+
+head -c 100 /dev/zero >> $SCRATCH/inodes.64
+size=$(stat -c %s $SCRATCH/inodes.64)
+
+echo -n "Testing afsck on a partial trailing block in $SCRATCH/inodes.64 ... "
+./bin/afsck $SCRATCH/inodes.64 > $SCRATCH/test.log 2>&1
+status=$?
+if [ $status = 8 ] &&
+   grep -q 'not a whole number' $SCRATCH/test.log &&
+   [ $(stat -c %s $SCRATCH/inodes.64) = $size ]; then
+    echo "Success"
+else
+    echo "Failure"
+    cat $SCRATCH/test.log
+fi
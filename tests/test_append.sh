@@ -0,0 +1,103 @@
+#!/bin/bash
+
+SCRATCH=$(mktemp -d)
+trap "rm -fr $SCRATCH" INT QUIT TERM EXIT
+
+# 3000 short lines, appended one at a time as a log writer would
+seq 1 3000 > $SCRATCH/log.txt
+
+# The last partial block stays in memory and the inode is written once at
+# the end, so each append costs a single block write
+
+echo -n "Testing append to preallocated file in $SCRATCH/image.200 ... "
+printf "format v2\n" | ./bin/afssh $SCRATCH/image.200 200 > /dev/null 2>&1
+printf "mount\ncreate\npreallocate 0 20000\nappend $SCRATCH/log.txt 0\n" | ./bin/afssh $SCRATCH/image.200 200 > $SCRATCH/test.log 2>&1
+printf "mount\nstat 0\ndebug\ncopyout 0 $SCRATCH/log.copy\n" | ./bin/afssh $SCRATCH/image.200 200 >> $SCRATCH/test.log 2>&1
+if grep -q '^preallocated 5 blocks for inode 0.' $SCRATCH/test.log &&
+   grep -q '^13893 bytes appended in 3000 appends' $SCRATCH/test.log &&
+   grep -q '^inode 0 has size 13893 bytes.' $SCRATCH/test.log &&
+   grep -q '^    preallocated' $SCRATCH/test.log &&
+   [ $(grep -m 1 'disk block writes' $SCRATCH/test.log | awk '{print $1}') -le 3010 ] &&
+   cmp -s $SCRATCH/log.txt $SCRATCH/log.copy &&
+   ./bin/afsck $SCRATCH/image.200 > /dev/null; then
+    echo "Success"
+else
+    echo "Failure"
+    cat $SCRATCH/test.log
+fi
+
+# Two files appended to in turn interleave their blocks, unless each has
+# reserved its space up front
+
+for i in $(seq 0 19); do
+    seq $((i * 1000)) $((i * 1000 + 799)) > $SCRATCH/$i.txt
+done
+
+test-input() {
+    echo mount
+    echo create
+    echo create
+    if [ -n "$1" ]; then
+    	echo preallocate 0 $1
+    	echo preallocate 1 $1
+    fi
+    for i in $(seq 0 19); do
+    	echo append $SCRATCH/$i.txt 0
+    	echo append $SCRATCH/$i.txt 1
+    done
+    echo defrag 0
+    echo defrag 1
+}
+
+echo -n "Testing interleaved appends in $SCRATCH/image.200 ... "
+printf "format v2\n" | ./bin/afssh $SCRATCH/image.200 200 > /dev/null 2>&1
+test-input | ./bin/afssh $SCRATCH/image.200 200 > $SCRATCH/test.log 2>&1
+printf "format v2\n" | ./bin/afssh $SCRATCH/image.200 200 > /dev/null 2>&1
+test-input 100000 | ./bin/afssh $SCRATCH/image.200 200 > $SCRATCH/preallocated.log 2>&1
+if grep -q '^inode 0: [2-9][0-9]* extents' $SCRATCH/test.log &&
+   grep -q '^inode 0: 1 extents, 0 blocks moved' $SCRATCH/preallocated.log &&
+   grep -q '^inode 1: 1 extents, 0 blocks moved' $SCRATCH/preallocated.log &&
+   ./bin/afsck $SCRATCH/image.200 > /dev/null; then
+    echo "Success"
+else
+    echo "Failure"
+    cat $SCRATCH/test.log $SCRATCH/preallocated.log
+fi
+
+# Remove, clone and defrag drop what append keeps for an inode, so appends
+# after them start from what is on disk
+
+seq 1 5000 > $SCRATCH/a.txt
+seq 7000 7100 > $SCRATCH/b.txt
+cat $SCRATCH/a.txt $SCRATCH/b.txt > $SCRATCH/ab.txt
+cat $SCRATCH/a.txt $SCRATCH/b.txt $SCRATCH/b.txt > $SCRATCH/abb.txt
+
+echo -n "Testing append after remove, clone and defrag in $SCRATCH/image.200 ... "
+printf "format v2\n" | ./bin/afssh $SCRATCH/image.200 200 > /dev/null 2>&1
+cat <<EOF2 | ./bin/afssh $SCRATCH/image.200 200 > $SCRATCH/test.log 2>&1
+mount
+create
+create
+append $SCRATCH/a.txt 0
+append $SCRATCH/a.txt 1
+defrag 0
+append $SCRATCH/b.txt 0
+clone 0
+append $SCRATCH/b.txt 0
+remove 1
+create
+append $SCRATCH/b.txt 1
+copyout 0 $SCRATCH/0.copy
+copyout 1 $SCRATCH/1.copy
+copyout 2 $SCRATCH/2.copy
+EOF2
+if grep -q '^cloned inode 0 to inode 2.' $SCRATCH/test.log &&
+   cmp -s $SCRATCH/abb.txt $SCRATCH/0.copy &&
+   cmp -s $SCRATCH/b.txt $SCRATCH/1.copy &&
+   cmp -s $SCRATCH/ab.txt $SCRATCH/2.copy &&
+   ./bin/afsck $SCRATCH/image.200 > /dev/null; then
+    echo "Success"
+else
+    echo "Failure"
+    cat $SCRATCH/test.log
+fi
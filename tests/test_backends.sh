@@ -0,0 +1,77 @@
+#!/bin/bash
+
+SCRATCH=$(mktemp -d)
+trap "rm -fr $SCRATCH" INT QUIT TERM EXIT
+
+# 100 blocks, so the file needs its indirect block
+head -c 409600 /dev/urandom > $SCRATCH/data.bin
+
+test-input() {
+    cat <<EOF2
+format
+mount
+create
+copyin $SCRATCH/data.bin 0
+create
+copyin README.md 1
+stat 0
+stat 1
+remove 1
+debug
+copyout 0 $1
+EOF2
+}
+
+# Every backend runs the file system the same way, down to the block counts
+
+echo -n "Testing file backend in $SCRATCH/image.200 ... "
+test-input $SCRATCH/file.copy | ./bin/afssh $SCRATCH/image.200 200 > $SCRATCH/file.log 2>&1
+if grep -q '409600 bytes copied' $SCRATCH/file.log &&
+   cmp -s $SCRATCH/data.bin $SCRATCH/file.copy; then
+    echo "Success"
+else
+    echo "Failure"
+    cat $SCRATCH/file.log
+fi
+
+for backend in ram hdd ssd; do
+    echo -n "Testing $backend backend ... "
+    test-input $SCRATCH/$backend.copy | ./bin/afssh -b $backend 200 > $SCRATCH/$backend.log 2>&1
+    if grep -v 'simulated' $SCRATCH/$backend.log | diff -q - $SCRATCH/file.log > /dev/null &&
+       cmp -s $SCRATCH/data.bin $SCRATCH/$backend.copy; then
+    	echo "Success"
+    else
+    	echo "Failure"
+    	diff $SCRATCH/file.log $SCRATCH/$backend.log
+    fi
+done
+
+# Simulated time is deterministic, and sequential requests cost an HDD far
+# less than scattered ones
+
+echo -n "Testing hdd model ... "
+test-input $SCRATCH/hdd.copy | ./bin/afssh -b hdd 200 > $SCRATCH/hdd.again 2>&1
+sequential=$(printf "debug\n" | ./bin/afssh -b hdd $SCRATCH/image.200 200 2>&1 | awk '/simulated/ {print $1}')
+scattered=$(printf "mount\nstat 0\n" | ./bin/afssh -b hdd $SCRATCH/image.200 200 2>&1 | awk '/simulated/ {print $1}')
+if cmp -s $SCRATCH/hdd.log $SCRATCH/hdd.again &&
+   awk "BEGIN {exit !($sequential > 0 && $sequential < $scattered)}"; then
+    echo "Success"
+else
+    echo "Failure"
+    echo "sequential $sequential, scattered $scattered"
+fi
+
+# Memory backends start from a copy of an image, and leave it untouched
+
+echo -n "Testing ram backend with data/image.20 ... "
+cp data/image.20 $SCRATCH/image.20
+printf "mount\ndebug\nremove 2\n" | ./bin/afssh $SCRATCH/image.20 20 > $SCRATCH/file.log 2>&1
+cp data/image.20 $SCRATCH/image.20
+printf "mount\ndebug\nremove 2\n" | ./bin/afssh -b ram $SCRATCH/image.20 20 > $SCRATCH/ram.log 2>&1
+if diff -q $SCRATCH/file.log $SCRATCH/ram.log > /dev/null &&
+   cmp -s data/image.20 $SCRATCH/image.20; then
+    echo "Success"
+else
+    echo "Failure"
+    diff $SCRATCH/file.log $SCRATCH/ram.log
+fi
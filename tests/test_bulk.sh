@@ -0,0 +1,54 @@
+#!/bin/bash
+
+SCRATCH=$(mktemp -d)
+trap "rm -fr $SCRATCH" INT QUIT TERM EXIT
+
+# A nested tree of 300 files, from empty to past the 1 MiB pipeline buffers
+mkdir -p $SCRATCH/tree/a/b $SCRATCH/tree/c
+for i in $(seq 1 300); do
+    head -c $((i * i * 17 % 200000)) /dev/urandom > $SCRATCH/tree/a/$i.bin
+done
+head -c 1500000 /dev/urandom > $SCRATCH/tree/a/b/large.bin
+: > $SCRATCH/tree/c/empty
+seq 1 1000 > $SCRATCH/tree/c/seq.txt
+
+# Files land in inodes in sorted path order, and export names them by inode
+
+echo -n "Testing import and export in $SCRATCH/image.20000 ... "
+printf "format v2\nmount\nimport $SCRATCH/tree\nexport $SCRATCH/out\nstat 302\nstat 303\n" | ./bin/afssh $SCRATCH/image.20000 20000 > $SCRATCH/test.log 2>&1
+inumber=0
+matched=0
+for path in $(cd $SCRATCH/tree && find . -type f | LC_ALL=C sort); do
+    cmp -s $SCRATCH/tree/$path $SCRATCH/out/$inumber && matched=$((matched + 1))
+    inumber=$((inumber + 1))
+done
+if grep -q '^imported 303 files' $SCRATCH/test.log &&
+   grep -q '^exported 303 files' $SCRATCH/test.log &&
+   grep -q '^inode 302 has size' $SCRATCH/test.log &&
+   grep -q '^stat failed!' $SCRATCH/test.log &&
+   [ $matched = 303 ] && [ $(ls $SCRATCH/out | wc -l) = 303 ] &&
+   ./bin/afsck $SCRATCH/image.20000 > /dev/null; then
+    echo "Success"
+else
+    echo "Failure"
+    cat $SCRATCH/test.log
+fi
+
+# A file larger than the free space is reported and skipped, leaving
+# nothing behind; the files after it are still imported
+
+echo -n "Testing failed import in $SCRATCH/image.20000 ... "
+head -c 60000000 /dev/urandom > $SCRATCH/tree/c/huge.bin
+printf "format v2\nmount\nimport $SCRATCH/tree\nstat 302\nstat 303\ncopyout 303 $SCRATCH/seq.copy\n" | ./bin/afssh $SCRATCH/image.20000 20000 > $SCRATCH/test.log 2>&1
+if grep -q "bytes of $SCRATCH/tree/c/huge.bin" $SCRATCH/test.log &&
+   grep -q '^imported 303 files' $SCRATCH/test.log &&
+   grep -q '^1 files skipped.' $SCRATCH/test.log &&
+   grep -q '^import failed!' $SCRATCH/test.log &&
+   grep -q '^stat failed!' $SCRATCH/test.log &&
+   cmp -s $SCRATCH/tree/c/seq.txt $SCRATCH/seq.copy &&
+   ./bin/afsck $SCRATCH/image.20000 > /dev/null; then
+    echo "Success"
+else
+    echo "Failure"
+    cat $SCRATCH/test.log
+fi
@@ -0,0 +1,73 @@
+#!/bin/bash
+
+SCRATCH=$(mktemp -d)
+trap "rm -fr $SCRATCH" INT QUIT TERM EXIT
+
+seq 1 3000  > $SCRATCH/medium.txt
+seq 1 20000 > $SCRATCH/large.txt
+(cat $SCRATCH/medium.txt; tail -c +$(($(stat -c %s $SCRATCH/medium.txt) + 1)) $SCRATCH/large.txt) > $SCRATCH/patched.txt
+
+# Clone a file, overwrite the start of the clone, then drop the original
+
+test-input() {
+    cat <<EOF2
+format v2
+mount
+create
+copyin $SCRATCH/large.txt 0
+clone 0
+snapshot
+copyin $SCRATCH/medium.txt 1
+copyout 0 $SCRATCH/0.copy
+copyout 1 $SCRATCH/1.copy
+remove 0
+copyout 2 $SCRATCH/2.copy
+EOF2
+}
+
+echo -n "Testing clone in $SCRATCH/image.200 ... "
+test-input | ./bin/afssh $SCRATCH/image.200 200 > $SCRATCH/test.log 2>&1
+if grep -q 'cloned inode 0 to inode 1.' $SCRATCH/test.log &&
+   grep -q 'snapshot of 2 inodes.' $SCRATCH/test.log &&
+   cmp -s $SCRATCH/large.txt $SCRATCH/0.copy &&
+   cmp -s $SCRATCH/patched.txt $SCRATCH/1.copy &&
+   cmp -s $SCRATCH/large.txt $SCRATCH/2.copy &&
+   ./bin/afsck $SCRATCH/image.200 > /dev/null; then
+    echo "Success"
+else
+    echo "Failure"
+    cat $SCRATCH/test.log
+fi
+
+# Defrag leaves a file that shares blocks with a clone where it is, and
+# says so
+
+test-input() {
+    cat <<EOF2
+format v2
+mount
+create
+copyin $SCRATCH/medium.txt 0
+create
+copyin $SCRATCH/medium.txt 1
+create
+copyin $SCRATCH/medium.txt 2
+remove 1
+create
+copyin $SCRATCH/large.txt 1
+clone 1
+defrag 1
+copyout 1 $SCRATCH/1.copy
+EOF2
+}
+
+echo -n "Testing defrag of a cloned file in $SCRATCH/image.200 ... "
+test-input | ./bin/afssh $SCRATCH/image.200 200 > $SCRATCH/test.log 2>&1
+if grep -q '^inode 1: [2-9][0-9]* extents, not moved: 27 blocks are shared with a clone.' $SCRATCH/test.log &&
+   cmp -s $SCRATCH/large.txt $SCRATCH/1.copy &&
+   ./bin/afsck $SCRATCH/image.200 > /dev/null; then
+    echo "Success"
+else
+    echo "Failure"
+    cat $SCRATCH/test.log
+fi
@@ -78,3 +78,24 @@ test-debug() {
 test-debug data/image.5   5   image-5-output
 test-debug data/image.20  20  image-20-output
 test-debug data/image.200 200 image-200-output
+
+# Debug lists version 2 inodes at their on-disk size, and does not walk an
+# image formatted for another block size
+
+SCRATCH=$(mktemp -d)
+trap "rm -fr $SCRATCH" INT QUIT TERM EXIT
+
+echo -n "Testing debug on version 2 images in $SCRATCH/image.20 ... "
+printf "format v2\nmount\ncreate\ncreate\nremove 0\n" | ./bin/afssh $SCRATCH/image.20 20 > /dev/null 2>&1
+printf "debug\n" | ./bin/afssh $SCRATCH/image.20 20 > $SCRATCH/test.log 2>&1
+printf '\x00\x40\x00\x00' | dd of=$SCRATCH/image.20 bs=1 seek=4 conv=notrunc 2> /dev/null
+printf "debug\n" | ./bin/afssh $SCRATCH/image.20 20 > $SCRATCH/other.log 2>&1
+if grep -q '^Inode 1:' $SCRATCH/test.log &&
+   ! grep -q '^Inode 0:' $SCRATCH/test.log &&
+   grep -q 'formatted with 16384 byte blocks' $SCRATCH/other.log &&
+   ! grep -q '^Inode' $SCRATCH/other.log; then
+    echo "Success"
+else
+    echo "Failure"
+    cat $SCRATCH/test.log $SCRATCH/other.log
+fi
@@ -0,0 +1,45 @@
+#!/bin/bash
+
+SCRATCH=$(mktemp -d)
+trap "rm -fr $SCRATCH" INT QUIT TERM EXIT
+
+# Fragment two large files by filling the holes left behind by removes
+
+seq 1 3000  > $SCRATCH/medium.txt
+seq 1 20000 > $SCRATCH/large.txt
+
+test-input() {
+    cat <<EOF2
+format
+mount
+create
+copyin $SCRATCH/medium.txt 0
+create
+copyin $SCRATCH/medium.txt 1
+create
+copyin $SCRATCH/medium.txt 2
+remove 1
+create
+copyin $SCRATCH/large.txt 1
+create
+copyin $SCRATCH/large.txt 3
+remove 2
+defrag 1
+defrag all 100000
+copyout 1 $SCRATCH/1.copy
+copyout 3 $SCRATCH/3.copy
+EOF2
+}
+
+echo -n "Testing defrag in $SCRATCH/image.200 ... "
+test-input | ./bin/afssh $SCRATCH/image.200 200 > $SCRATCH/test.log 2>&1
+if grep -q 'inode 1: 3 extents, 27 blocks moved, now 1 extents.' $SCRATCH/test.log &&
+   grep -q 'inode 3: 2 extents, 27 blocks moved, now 1 extents.' $SCRATCH/test.log &&
+   cmp -s $SCRATCH/large.txt $SCRATCH/1.copy &&
+   cmp -s $SCRATCH/large.txt $SCRATCH/3.copy &&
+   ./bin/afsck $SCRATCH/image.200 > /dev/null; then
+    echo "Success"
+else
+    echo "Failure"
+    cat $SCRATCH/test.log
+fi
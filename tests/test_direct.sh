@@ -0,0 +1,51 @@
+#!/bin/bash
+
+SCRATCH=$(mktemp -d)
+trap "rm -fr $SCRATCH" INT QUIT TERM EXIT
+
+# 100 blocks, so the file needs its indirect block
+head -c 409600 /dev/urandom > $SCRATCH/data.bin
+
+test-input() {
+    cat <<EOF2
+format
+mount
+create
+copyin $SCRATCH/data.bin 0
+create
+copyin README.md 1
+remove 1
+debug
+copyout 0 $1
+EOF2
+}
+
+# O_DIRECT images bypass the page cache, but the file system sees the same
+# blocks: the session matches one on a buffered image exactly
+
+echo -n "Testing O_DIRECT disk in $SCRATCH/direct.200 ... "
+if ! dd if=/dev/zero of=$SCRATCH/probe bs=4096 count=1 oflag=direct 2> /dev/null; then
+    echo "Skipped"
+    exit 0
+fi
+test-input $SCRATCH/buffered.copy | ./bin/afssh $SCRATCH/buffered.200 200 2>&1 | sed "s|buffered|direct|g" > $SCRATCH/buffered.log
+test-input $SCRATCH/direct.copy | ./bin/afssh -d $SCRATCH/direct.200 200 > $SCRATCH/direct.log 2>&1
+if grep -q '409600 bytes copied' $SCRATCH/direct.log &&
+   diff -q $SCRATCH/buffered.log $SCRATCH/direct.log > /dev/null &&
+   cmp -s $SCRATCH/data.bin $SCRATCH/direct.copy &&
+   cmp -s $SCRATCH/buffered.200 $SCRATCH/direct.200; then
+    echo "Success"
+else
+    echo "Failure"
+    diff $SCRATCH/buffered.log $SCRATCH/direct.log
+fi
+
+echo -n "Testing striped O_DIRECT disk in $SCRATCH ... "
+test-input $SCRATCH/striped.copy | ./bin/afssh -d -s 2 $SCRATCH/a.img,$SCRATCH/b.img 200 > $SCRATCH/striped.log 2>&1
+if grep -q '409600 bytes copied' $SCRATCH/striped.log &&
+   cmp -s $SCRATCH/data.bin $SCRATCH/striped.copy; then
+    echo "Success"
+else
+    echo "Failure"
+    cat $SCRATCH/striped.log
+fi
@@ -8,6 +8,8 @@ SuperBlock:
     5 blocks
     1 inode blocks
     128 inodes
+    1 checksum blocks
+    4096 bytes per block
 2 disk block reads
 5 disk block writes
 EOF
@@ -21,6 +23,8 @@ SuperBlock:
     20 blocks
     2 inode blocks
     256 inodes
+    1 checksum blocks
+    4096 bytes per block
 3 disk block reads
 20 disk block writes
 EOF
@@ -34,6 +38,8 @@ SuperBlock:
     200 blocks
     20 inode blocks
     2560 inodes
+    1 checksum blocks
+    4096 bytes per block
 21 disk block reads
 200 disk block writes
 EOF
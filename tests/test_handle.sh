@@ -0,0 +1,35 @@
+#!/bin/bash
+
+SCRATCH=$(mktemp -d)
+trap "rm -fr $SCRATCH" INT QUIT TERM EXIT
+
+# 100 blocks, so the file needs its indirect block
+head -c 409600 /dev/urandom > $SCRATCH/data.bin
+
+# Copying a file in through one handle should only cost its data blocks,
+# plus the inode, indirect and checksum blocks once at close (mount itself
+# reads the 21 metadata blocks)
+
+test-input() {
+    cat <<EOF2
+mount
+create
+copyin $SCRATCH/data.bin 0
+EOF2
+}
+
+echo -n "Testing open file handles in $SCRATCH/image.200 ... "
+printf "format\n" | ./bin/afssh $SCRATCH/image.200 200 > /dev/null 2>&1
+test-input | ./bin/afssh $SCRATCH/image.200 200 > $SCRATCH/test.log 2>&1
+printf "mount\ncopyout 0 $SCRATCH/data.copy\n" | ./bin/afssh $SCRATCH/image.200 200 >> $SCRATCH/test.log 2>&1
+reads=$(awk '/disk block reads/ {print $1; exit}' $SCRATCH/test.log)
+writes=$(awk '/disk block writes/ {print $1; exit}' $SCRATCH/test.log)
+if grep -q '409600 bytes copied' $SCRATCH/test.log &&
+   [ "$reads" -le 30 ] && [ "$writes" -le 106 ] &&
+   cmp -s $SCRATCH/data.bin $SCRATCH/data.copy &&
+   ./bin/afsck $SCRATCH/image.200 > /dev/null; then
+    echo "Success"
+else
+    echo "Failure"
+    cat $SCRATCH/test.log
+fi
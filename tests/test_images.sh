@@ -0,0 +1,64 @@
+#!/bin/bash
+
+SCRATCH=$(mktemp -d)
+trap "rm -fr $SCRATCH" INT QUIT TERM EXIT
+
+# Images made before checksums carry undefined bytes after the inode count
+# of their superblock; they must still mount (image.26 has garbage there)
+
+for image in data/image.*; do
+    echo -n "Testing mount on $image ... "
+    cp $image $SCRATCH/image
+    if printf "mount\n" | ./bin/afssh $SCRATCH/image ${image##*.} 2> /dev/null | grep -q '^disk mounted.' &&
+       ./bin/afsck $SCRATCH/image > /dev/null; then
+    	echo "Success"
+    else
+    	echo "Failure"
+    fi
+done
+
+# An inode block that fails its checksum stops the mount
+
+echo -n "Testing mount with corrupt inode block in $SCRATCH/image.200 ... "
+printf "format\nmount\ncreate\ncopyin README.md 0\n" | ./bin/afssh $SCRATCH/image.200 200 > /dev/null 2>&1
+printf '\xff' | dd of=$SCRATCH/image.200 bs=1 seek=$((4096 + 4)) conv=notrunc 2> /dev/null
+printf "mount\n" | ./bin/afssh $SCRATCH/image.200 200 > $SCRATCH/test.log 2> /dev/null
+if grep -q '^mount failed!' $SCRATCH/test.log &&
+   grep -q '^1 checksum errors' $SCRATCH/test.log; then
+    echo "Success"
+else
+    echo "Failure"
+    cat $SCRATCH/test.log
+fi
+
+# A data block that fails its checksum ends a read early: the blocks before
+# it are still returned, and the next read fails
+
+echo -n "Testing copyout across a corrupt data block in $SCRATCH/image.200 ... "
+head -c $((40 * 4096)) /dev/urandom > $SCRATCH/data.bin
+printf "format v2\nmount\ncreate\ncopyin $SCRATCH/data.bin 0\ndebug\n" | ./bin/afssh $SCRATCH/image.200 200 > $SCRATCH/test.log 2>&1
+block=$(grep -E '^    (direct|indirect data) blocks:' $SCRATCH/test.log | cut -d: -f2 | tr ' ' '\n' | grep . | sed -n 31p)
+printf '\xff' | dd of=$SCRATCH/image.200 bs=1 seek=$((block * 4096)) conv=notrunc 2> /dev/null
+printf "mount\ncopyout 0 $SCRATCH/data.copy\n" | ./bin/afssh $SCRATCH/image.200 200 > $SCRATCH/test.log 2>&1
+if grep -q "^checksum mismatch on block $block" $SCRATCH/test.log &&
+   grep -q "^$((30 * 4096)) bytes copied" $SCRATCH/test.log &&
+   cmp -s -n $((30 * 4096)) $SCRATCH/data.bin $SCRATCH/data.copy; then
+    echo "Success"
+else
+    echo "Failure"
+    cat $SCRATCH/test.log
+fi
+
+# A block pointer outside the data blocks stops the mount, even when no
+# checksum catches it
+
+echo -n "Testing mount with a bad block pointer in $SCRATCH/image.5 ... "
+cp data/image.5 $SCRATCH/image.5
+printf '\xff\xff\xff\x00' | dd of=$SCRATCH/image.5 bs=1 seek=$((4096 + 32 + 8)) conv=notrunc 2> /dev/null
+printf "mount\n" | ./bin/afssh $SCRATCH/image.5 5 > $SCRATCH/test.log 2>&1
+if grep -q 'mount failed!' $SCRATCH/test.log; then
+    echo "Success"
+else
+    echo "Failure"
+    cat $SCRATCH/test.log
+fi
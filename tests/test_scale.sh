@@ -0,0 +1,89 @@
+#!/bin/bash
+
+SCRATCH=$(mktemp -d)
+trap "rm -fr $SCRATCH" INT QUIT TERM EXIT
+
+# Version 2 images are sparse, and mounting them reads no more than the
+# superblock, so multi-terabyte file systems fit in a small address space.
+
+ulimit -v 262144
+
+for i in $(seq 0 9); do
+    seq $((i * 1000)) $((i * 1000 + 999)) > $SCRATCH/$i.txt
+done
+
+# 1 TiB, 1 million inodes: fill a thousand files, remount and read them back
+
+test-input-1t() {
+    echo format v2 1048576
+    echo mount
+    for i in $(seq 0 999); do
+    	echo create
+    	echo copyin $SCRATCH/$((i % 10)).txt $i
+    done
+}
+
+echo -n "Testing v2 format in $SCRATCH/image.1t ... "
+if ! truncate -s 1T $SCRATCH/image.1t 2> /dev/null; then
+    echo "Skipped"
+    exit 0
+fi
+test-input-1t | ./bin/afssh $SCRATCH/image.1t 268435456 > $SCRATCH/test.log 2> /dev/null
+if grep -q '^created inode 999.' $SCRATCH/test.log &&
+   [ $(grep -c 'bytes copied' $SCRATCH/test.log) = 1000 ] &&
+   [ $(du -m $SCRATCH/image.1t | awk '{print $1}') -lt 64 ]; then
+    echo "Success"
+else
+    echo "Failure"
+    tail $SCRATCH/test.log
+fi
+
+echo -n "Testing v2 remount in $SCRATCH/image.1t ... "
+printf "mount\nstat 999\ncopyout 7 $SCRATCH/7.copy\ncopyout 998 $SCRATCH/998.copy\nremove 7\ncreate\ntrim\n" | ./bin/afssh $SCRATCH/image.1t 268435456 > $SCRATCH/test.log 2>&1
+if grep -q '^inode 999 has size 5000 bytes.' $SCRATCH/test.log &&
+   grep -q '^created inode 7.' $SCRATCH/test.log &&
+   grep -q '^trimmed [0-9]* blocks.' $SCRATCH/test.log &&
+   cmp -s $SCRATCH/7.txt $SCRATCH/7.copy &&
+   cmp -s $SCRATCH/8.txt $SCRATCH/998.copy; then
+    echo "Success"
+else
+    echo "Failure"
+    cat $SCRATCH/test.log
+fi
+
+# A file past version 1's 4 MiB limit needs a double indirect tree, on the
+# full 1 TiB image and on a small one afsck can check
+
+head -c 20000000 /dev/urandom > $SCRATCH/large.bin
+
+echo -n "Testing v2 large file in $SCRATCH/image.1t ... "
+printf "mount\ncreate\ncopyin $SCRATCH/large.bin 1000\n" | ./bin/afssh $SCRATCH/image.1t 268435456 > $SCRATCH/test.log 2>&1
+printf "mount\nstat 1000\ncopyout 1000 $SCRATCH/large.copy\n" | ./bin/afssh $SCRATCH/image.1t 268435456 >> $SCRATCH/test.log 2>&1
+printf "format v2\nmount\ncreate\ncopyin $SCRATCH/large.bin 0\ndebug\n" | ./bin/afssh $SCRATCH/image.16384 16384 >> $SCRATCH/test.log 2>&1
+if grep -q '^created inode 1000.' $SCRATCH/test.log &&
+   grep -q '^inode 1000 has size 20000000 bytes.' $SCRATCH/test.log &&
+   grep -q '^    level 1 pointer blocks:' $SCRATCH/test.log &&
+   cmp -s $SCRATCH/large.bin $SCRATCH/large.copy &&
+   ./bin/afsck $SCRATCH/image.16384 > /dev/null; then
+    echo "Success"
+else
+    echo "Failure"
+    grep -v 'blocks:' $SCRATCH/test.log
+fi
+rm -f $SCRATCH/image.1t $SCRATCH/image.16384
+
+# 12 TiB, with so many inodes that the first data block is past 2^31
+
+echo -n "Testing v2 format in $SCRATCH/image.12t ... "
+printf "format v2 96\nmount\ncreate\ncopyin $SCRATCH/3.txt 0\ncreate\ncopyin $SCRATCH/4.txt 1\n" | ./bin/afssh $SCRATCH/image.12t 3221225472 > /dev/null 2>&1
+printf "mount\nstat 0\ncopyout 1 $SCRATCH/1.copy\n" | ./bin/afssh $SCRATCH/image.12t 3221225472 > $SCRATCH/test.log 2>&1
+# 2147483648 inode blocks, then 3145728 each of checksum and refcount blocks
+dd if=$SCRATCH/image.12t of=$SCRATCH/data.copy bs=4096 skip=2153775105 count=2 2> /dev/null
+if grep -q '^inode 0 has size 5000 bytes.' $SCRATCH/test.log &&
+   cmp -s $SCRATCH/4.txt $SCRATCH/1.copy &&
+   cmp -s -n 5000 $SCRATCH/3.txt $SCRATCH/data.copy; then
+    echo "Success"
+else
+    echo "Failure"
+    cat $SCRATCH/test.log
+fi
@@ -0,0 +1,47 @@
+#!/bin/bash
+
+SCRATCH=$(mktemp -d)
+trap "rm -fr $SCRATCH" INT QUIT TERM EXIT
+
+# 100 blocks, so the files need their indirect blocks
+head -c 409600 /dev/urandom > $SCRATCH/data.bin
+
+test-input() {
+    cat <<EOF2
+format $1
+mount
+create
+copyin $SCRATCH/data.bin 0
+create
+copyin README.md 1
+create
+copyin $SCRATCH/data.bin 2
+remove 1
+create
+copyin tests/test_scan.sh 1
+debug
+mount
+trim
+EOF2
+}
+
+# Mount, debug and free space searches give the same answers whichever scan
+# kernels do the work (AFS_SCAN falls back to the best one the CPU has)
+
+for version in v1 v2; do
+    echo -n "Testing metadata scans on $version in $SCRATCH/image.400 ... "
+    for scan in scalar sse2 avx2; do
+    	rm -f $SCRATCH/image.400
+    	test-input $version | AFS_SCAN=$scan ./bin/afssh $SCRATCH/image.400 400 > $SCRATCH/$scan.log 2>&1
+    	printf "mount\ndebug\ncopyout 2 $SCRATCH/$scan.copy\n" | AFS_SCAN=$scan ./bin/afssh $SCRATCH/image.400 400 >> $SCRATCH/$scan.log 2>&1
+    done
+    if grep -q 'indirect data blocks: [0-9]' $SCRATCH/scalar.log &&
+       diff -q $SCRATCH/scalar.log $SCRATCH/sse2.log > /dev/null &&
+       diff -q $SCRATCH/scalar.log $SCRATCH/avx2.log > /dev/null &&
+       cmp -s $SCRATCH/data.bin $SCRATCH/avx2.copy; then
+    	echo "Success"
+    else
+    	echo "Failure"
+    	diff $SCRATCH/scalar.log $SCRATCH/avx2.log
+    fi
+done
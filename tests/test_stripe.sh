@@ -0,0 +1,44 @@
+#!/bin/bash
+
+SCRATCH=$(mktemp -d)
+trap "rm -fr $SCRATCH" INT QUIT TERM EXIT
+
+# 100 blocks, so the file spans every member many times over
+head -c 409600 /dev/urandom > $SCRATCH/data.bin
+
+IMAGES=$SCRATCH/a.img,$SCRATCH/b.img,$SCRATCH/c.img
+
+# 200 blocks over three members in units of 4 blocks: each member holds
+# ceil(200 / 12) = 17 stripe units
+
+echo -n "Testing striped disk in $IMAGES ... "
+printf "format\n" | ./bin/afssh -s 4 $IMAGES 200 > /dev/null 2>&1
+printf "mount\ncreate\ncopyin $SCRATCH/data.bin 0\n" | ./bin/afssh -s 4 $IMAGES 200 > $SCRATCH/test.log 2>&1
+printf "mount\ncopyout 0 $SCRATCH/data.copy\n" | ./bin/afssh -s 4 $IMAGES 200 >> $SCRATCH/test.log 2>&1
+if grep -q '409600 bytes copied' $SCRATCH/test.log &&
+   cmp -s $SCRATCH/data.bin $SCRATCH/data.copy &&
+   [ $(stat -c %s $SCRATCH/a.img) = 278528 ] &&
+   [ $(stat -c %s $SCRATCH/b.img) = 278528 ] &&
+   [ $(stat -c %s $SCRATCH/c.img) = 278528 ] &&
+   [ "$(tr -d '\0' < $SCRATCH/c.img | head -c 1 | wc -c)" = 1 ]; then
+    echo "Success"
+else
+    echo "Failure"
+    cat $SCRATCH/test.log
+fi
+
+# Interleaving the members' stripe units back together gives a plain image
+
+echo -n "Testing striped disk layout in $IMAGES ... "
+for unit in $(seq 0 49); do
+    member=$(echo a b c | cut -d ' ' -f $((unit % 3 + 1)))
+    dd if=$SCRATCH/$member.img bs=4096 skip=$((unit / 3 * 4)) count=4 2> /dev/null
+done > $SCRATCH/image.200
+printf "mount\ncopyout 0 $SCRATCH/plain.copy\n" | ./bin/afssh $SCRATCH/image.200 200 > $SCRATCH/test.log 2>&1
+if cmp -s $SCRATCH/data.bin $SCRATCH/plain.copy &&
+   ./bin/afsck $SCRATCH/image.200 > /dev/null; then
+    echo "Success"
+else
+    echo "Failure"
+    cat $SCRATCH/test.log
+fi
@@ -0,0 +1,44 @@
+#!/bin/bash
+
+SCRATCH=$(mktemp -d)
+trap "rm -fr $SCRATCH" INT QUIT TERM EXIT
+
+seq 1 3000 > $SCRATCH/data.txt
+
+test-input() {
+    cat <<EOF2
+format v2
+mount
+create
+trace start
+create
+copyin $SCRATCH/data.txt 1
+copyout 1 $SCRATCH/data.copy
+remove 1
+trace stop
+create
+trace dump $SCRATCH/trace.json
+EOF2
+}
+
+# Only calls made between start and stop are traced: one create, one write
+# through the copyin handle, and the disk writes nested inside them. The
+# striped image adds a span per member for multi-block transfers.
+
+echo -n "Testing trace in $SCRATCH ... "
+test-input | ./bin/afssh -s 2 $SCRATCH/a.img,$SCRATCH/b.img 200 > $SCRATCH/test.log 2>&1
+events=$(grep -c '"ph": "X"' $SCRATCH/trace.json)
+if grep -q "^$events trace events written to $SCRATCH/trace.json (0 dropped)." $SCRATCH/test.log &&
+   [ $(head -c 15 $SCRATCH/trace.json) = '{"displayTimeUn' ] &&
+   [ "$(tail -n 1 $SCRATCH/trace.json)" = ']}' ] &&
+   [ $(grep -c '"name": "create"' $SCRATCH/trace.json) = 1 ] &&
+   [ $(grep -c '"name": "write"' $SCRATCH/trace.json) = 1 ] &&
+   [ $(grep -c '"name": "remove"' $SCRATCH/trace.json) = 1 ] &&
+   grep -q '"name": "disk write", .*"args": {"block": [0-9]*}' $SCRATCH/trace.json &&
+   grep -q '"name": "member read", .*"args": {"member": 1}' $SCRATCH/trace.json &&
+   cmp -s $SCRATCH/data.txt $SCRATCH/data.copy; then
+    echo "Success"
+else
+    echo "Failure"
+    cat $SCRATCH/test.log
+fi
@@ -0,0 +1,41 @@
+#!/bin/bash
+
+SCRATCH=$(mktemp -d)
+trap "rm -fr $SCRATCH" INT QUIT TERM EXIT
+
+seq 1 100000 > $SCRATCH/huge.txt
+seq 1 20000  > $SCRATCH/large.txt
+
+cat <<EOF2 | ./bin/afssh $SCRATCH/image.2000 2000 > /dev/null 2>&1
+format
+mount
+create
+copyin $SCRATCH/huge.txt 0
+create
+copyin $SCRATCH/large.txt 1
+EOF2
+
+# Removing a file with discard on punches its 144 data blocks and indirect block
+
+echo -n "Testing discard in $SCRATCH/image.2000 ... "
+if printf "mount\ndiscard on\nremove 0\n" | ./bin/afssh $SCRATCH/image.2000 2000 2> /dev/null | grep -q '^145 disk block discards'; then
+    echo "Success"
+else
+    echo "Failure"
+fi
+
+# Trimming punches every free data block and leaves the rest alone
+
+echo -n "Testing trim in $SCRATCH/image.2000 ... "
+BEFORE=$(du -k $SCRATCH/image.2000 | awk '{print $1}')
+printf "mount\ntrim\ncopyout 1 $SCRATCH/1.copy\n" | ./bin/afssh $SCRATCH/image.2000 2000 > $SCRATCH/test.log 2>&1
+AFTER=$(du -k $SCRATCH/image.2000 | awk '{print $1}')
+if grep -q '^trimmed 1769 blocks.' $SCRATCH/test.log &&
+   [ $AFTER -lt $BEFORE ] &&
+   cmp -s $SCRATCH/large.txt $SCRATCH/1.copy &&
+   ./bin/afsck $SCRATCH/image.2000 > /dev/null; then
+    echo "Success"
+else
+    echo "Failure"
+    cat $SCRATCH/test.log
+fi